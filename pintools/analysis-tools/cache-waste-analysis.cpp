@@ -1,5 +1,7 @@
 /*
  * This tool reads a file containing a memtracker trace, the text version. 
+ * The trace may be compressed with gzip, bzip2, xz or zstd, or it may be
+ * read from stdin, so the tool can be run at the end of a pipe with memtracker.
  * The trace has the following format:
  * <access_type> <tid> <addr> <size> <func> <access_source> <alloc_source> <name> <type>
  *
@@ -14,6 +16,9 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
 #include <assert.h>
 #include <fstream>
 #include <iomanip>
@@ -29,9 +34,12 @@
 #include <sys/syscall.h>
 #include <ctgmath>
 #include <stdlib.h>
+#include <string.h>
 #include <algorithm>
 #include <unordered_map>
 #include <tuple>
+#include <vector>
+#include <random>
 
 using namespace std;
 
@@ -40,6 +48,7 @@ using namespace std;
 bool WANT_RAW_OUTPUT = 0;
 
 #define MAX_LINE_SIZE 64 /* We need this in order to use the bitset class */
+#define KILOBYTE 1024
 
 /* Default cache size parameters for a 2MB 4-way set associative cache */
 int NUM_SETS = 8*1024;
@@ -57,62 +66,247 @@ int indexBits;
 int tagMaskBits;
 
 /* The following data structures are used to summarize
- * the cache waste per source location. 
+ * the cache waste per source location. We do not keep a record
+ * for every evicted cache line, because the number of evictions
+ * grows with the length of the trace. Instead, for every access site
+ * we keep the aggregate counters and a small sample of example
+ * records, so the memory we use is proportional to the number of
+ * distinct access sites.
  */
 class WasteRecord
 {
 public:
     string varInfo;
     size_t address;
+    int byteUseCount;
 
-    WasteRecord(string vI = "", size_t addr=0)
-	: varInfo(vI), address(addr){}
+    WasteRecord(string vI = "", size_t addr=0, int bC = 0)
+	: varInfo(vI), address(addr), byteUseCount(bC){}
 };
     
 
 class ZeroReuseRecord: public WasteRecord
 {
 public:
-    ZeroReuseRecord(string vI, size_t addr)
-	{
-	    varInfo = vI;
-	    address = addr;
-	}
+    ZeroReuseRecord(string vI = "", size_t addr = 0, int bC = 0)
+	: WasteRecord(vI, addr, bC){}
 
     friend std::ostream& operator<< (std::ostream& stream, const ZeroReuseRecord& zrr)
 	{
-	    cout << "\t" << zrr.varInfo << endl;
-	    cout << "\t0x" << hex << zrr.address << dec << endl;
+	    stream << "\t" << zrr.varInfo << endl;
+	    stream << "\t0x" << hex << zrr.address << dec << endl;
+	    return stream;
 	}
 };
 
 class LowUtilRecord: public WasteRecord
 {
 public:
-    int byteUseCount;
+    LowUtilRecord(string vI = "", size_t addr = 0, int bC = 0)
+	: WasteRecord(vI, addr, bC){}
 
-    LowUtilRecord(string vI, size_t addr, int bC)
+    friend std::ostream& operator<< (std::ostream& stream, const LowUtilRecord& lur)
 	{
-	    this->varInfo = vI;
-	    this->byteUseCount = bC;
-	    this->address = addr;
+	    stream << "\t--------------------------------------------" << endl;
+	    stream << "\t" << lur.varInfo << endl;
+	    stream << "\t0x" << hex << lur.address << dec << endl;
+	    stream << "\t" << lur.byteUseCount << "/" << CACHE_LINE_SIZE << endl;
+	    return stream;
 	}
 
-    friend std::ostream& operator<< (std::ostream& stream, const LowUtilRecord& lur)
+};
+
+/* How many example records we keep for each access site.
+ * Can be changed with the -e option.
+ */
+int SAMPLE_SIZE = 8;
+
+/* We use a fixed seed, so that the same trace always produces
+ * the same sample of example records. */
+minstd_rand sampleRNG(1);
+
+/* Aggregate waste counters for one access site and one kind of waste. 
+ * We count the waste occurrences, keep a histogram of how many bytes
+ * of the evicted cache line were used, and keep a bounded reservoir
+ * sample of example records (varInfo and address), which is
+ * a uniform sample of all occurrences we have seen.
+ */
+template <class T>
+class WasteSummary
+{
+public:
+    size_t count;
+    vector<size_t> byteUseHist; /* byteUseHist[i] is the number of lines
+				 * with i bytes used when evicted */
+    vector<T> samples;
+
+    WasteSummary()
+	: count(0), byteUseHist(CACHE_LINE_SIZE + 1, 0) {}
+
+    void add(const T& rec)
 	{
-	    cout << "\t--------------------------------------------" << endl;
-	    cout << "\t" << lur.varInfo << endl;
-	    cout << "\t0x" << hex << lur.address << dec << endl;
-	    cout << "\t" << lur.byteUseCount << "/" << CACHE_LINE_SIZE << endl;
+	    count++;
+	    byteUseHist[rec.byteUseCount]++;
+
+	    if(samples.size() < (size_t)SAMPLE_SIZE)
+		samples.push_back(rec);
+	    else
+	    {
+		/* Reservoir sampling: the new record replaces one of the
+		 * samples with the probability SAMPLE_SIZE/count. */
+		size_t slot = sampleRNG() % count;
+		if(slot < samples.size())
+		    samples[slot] = rec;
+	    }
 	}
+};
+
+/* All the waste information we keep about one access site. 
+ * Cache lines point to the record of the site that brought them 
+ * into the cache, so on eviction we update the counters in place.
+ */
+class SiteRecord
+{
+public:
+    string accessSite;
+    size_t accesses;
+    size_t misses;
+    WasteSummary<ZeroReuseRecord> zeroReuse;
+    WasteSummary<LowUtilRecord> lowUtil;
+
+    SiteRecord(string site = "")
+	: accessSite(site), accesses(0), misses(0) {}
+};
 
+unordered_map <string, SiteRecord> siteMap;
+
+/* Return the record for this access site, creating it if it is not
+ * there. Pointers to elements of an unordered_map remain valid as the
+ * map grows, so the cache lines can hold on to them.
+ */
+SiteRecord *findSiteRecord(const string &accessSite)
+{
+    auto it = siteMap.find(accessSite);
+
+    if(it == siteMap.end())
+	it = siteMap.insert(make_pair(accessSite, SiteRecord(accessSite))).first;
+
+    return &(it->second);
+}
+
+/* The following data structures break down the accesses, misses and
+ * waste by thread, by phase and by time. A phase is the outermost
+ * function on the thread's stack of function-begin/function-end
+ * records in the trace -- that is, the tracked function within which
+ * memtracker began recording accesses. Time is measured in access records:
+ * the time series has a bucket for every TIME_BUCKET_SIZE records.
+ */
+class BreakdownStats
+{
+public:
+    size_t accesses;
+    size_t misses;
+    size_t zeroReuse;
+    size_t lowUtil;
+
+    BreakdownStats()
+	: accesses(0), misses(0), zeroReuse(0), lowUtil(0) {}
 };
 
-unordered_multimap <string, ZeroReuseRecord> zeroReuseMap;
-unordered_multimap <string, LowUtilRecord> lowUtilMap;
+class AccessContext
+{
+public:
+    int tid;
+    int phase;       /* index into phaseNames */
+    size_t bucket;   /* index into timeSeries */
+
+    AccessContext()
+	: tid(0), phase(0), bucket(0) {}
+};
+
+/* The context of the access record we are simulating right now */
+AccessContext curContext;
+
+/* Number of access records in one bucket of the time series. 
+ * Zero means we don't keep the time series. Set with the -b option. */
+size_t TIME_BUCKET_SIZE = 0;
+size_t numAccessRecords = 0;
+
+map<int, BreakdownStats> threadStats;
+vector<string> phaseNames(1, "<no function>");
+vector<BreakdownStats> phaseStats(1);
+unordered_map<string, int> phaseIds;
+vector<BreakdownStats> timeSeries;
+
+/* For every thread, the phase ids of the functions it is in */
+unordered_map<int, vector<int>> threadFuncStacks;
+
+int findPhase(const string &funcName)
+{
+    auto it = phaseIds.find(funcName);
+
+    if(it != phaseIds.end())
+	return it->second;
+
+    phaseNames.push_back(funcName);
+    phaseStats.push_back(BreakdownStats());
+    phaseIds[funcName] = phaseNames.size() - 1;
+    return phaseNames.size() - 1;
+}
+
+/* Set up the context for the next access record of this thread */
+void beginAccess(int tid)
+{
+    vector<int> &stack = threadFuncStacks[tid];
+
+    curContext.tid = tid;
+    curContext.phase = stack.empty() ? 0 : stack.front();
+    curContext.bucket = 0;
+
+    if(TIME_BUCKET_SIZE > 0)
+    {
+	curContext.bucket = numAccessRecords / TIME_BUCKET_SIZE;
+	if(timeSeries.size() <= curContext.bucket)
+	    timeSeries.resize(curContext.bucket + 1);
+	timeSeries[curContext.bucket].accesses++;
+    }
+
+    numAccessRecords++;
+    threadStats[tid].accesses++;
+    phaseStats[curContext.phase].accesses++;
+}
+
+/* Called on every cache miss of the current access record */
+void countMiss()
+{
+    threadStats[curContext.tid].misses++;
+    phaseStats[curContext.phase].misses++;
+    if(TIME_BUCKET_SIZE > 0)
+	timeSeries[curContext.bucket].misses++;
+}
 
-multimap <int, tuple<string, vector<ZeroReuseRecord>>> groupedZeroReuseMap;
-multimap <int, tuple<string, vector<LowUtilRecord>>> groupedLowUtilMap;
+/* Called when a cache line is evicted. We attribute the waste to the
+ * thread and phase that brought the line into the cache, and to the 
+ * time bucket when the line was evicted, which is when we learn
+ * that the line was wasted.
+ */
+void countWaste(const AccessContext &owner, bool zeroReuse, bool lowUtil)
+{
+    BreakdownStats *stats[3] = {&threadStats[owner.tid], 
+				&phaseStats[owner.phase], 
+				TIME_BUCKET_SIZE > 0 ? 
+				&timeSeries[curContext.bucket] : NULL};
+
+    for(BreakdownStats *bs: stats)
+    {
+	if(bs == NULL)
+	    continue;
+	if(zeroReuse)
+	    bs->zeroReuse++;
+	if(lowUtil)
+	    bs->lowUtil++;
+    }
+}
 
 /***************************************************************************
  * BEGIN CACHE SIMULATION CODE
@@ -133,12 +327,14 @@ class CacheLine
 public:
     size_t address;    /* virtual address responsible for populating this cache line */
     size_t tag; 
-    string accessSite; /* which code location caused that data to be brought 
+    SiteRecord *site;  /* which code location caused that data to be brought 
 			* into the cache line? */
     unsigned short initAccessSize; /* The size of the access that brought 
 				      this line into cache */
     string varInfo;    /* the name and the type of the corresponding variable,
 			* if we know it. */
+    AccessContext owner; /* the thread and phase that brought that data 
+			  * into the cache line */
     bitset<MAX_LINE_SIZE> *bytesUsed; /* This is a bitmap. There is a bit for each byte in the
 			* cache line. If a byte sitting in the cache line is
 			* accessed by the user program, we mark it as "accessed"
@@ -159,7 +355,7 @@ public:
 	    address = 0;
 	    tag = 0;
 	    initAccessSize = 0;
-	    accessSite = "";
+	    site = NULL;
 	    varInfo = "";
 	    timesReusedBeforeEvicted = 0;
 	    timeStamp = 0;
@@ -172,17 +368,19 @@ public:
     void printFaultingAccessInfo()
 	{
 	    cout<< "0x" << hex << address << dec << " " << initAccessSize << " "
-		<< accessSite << varInfo << endl;
+		<< (site ? site->accessSite : "") << varInfo << endl;
 	}
 
     void setAndAccess(size_t address, unsigned short accessSize, 
-		      string accessSite, string varInfo, size_t timeStamp)
+		      SiteRecord *site, const string &varInfo, size_t timeStamp)
 	{
 	    this->address = address;
 	    this->initAccessSize = accessSize;
 	    tag = address >> tagMaskBits;
-	    this->accessSite = accessSite;
+	    this->site = site;
 	    this->varInfo = varInfo;
+	    this->timeStamp = timeStamp;
+	    owner = curContext;
 	    timesReusedBeforeEvicted = 0;
 	    bytesUsed->reset();
 
@@ -191,7 +389,9 @@ public:
 
     bool valid(size_t address)
 	{
-	    if(address >> tagMaskBits == tag)
+	    /* A clean line has a timestamp of zero and holds no data,
+	     * even though its tag may match the address. */
+	    if(timeStamp != 0 && address >> tagMaskBits == tag)
 		return true;
 	    
 	    return false;
@@ -228,31 +428,30 @@ public:
     void evict()
 	{
 
-	    /* We are being evicted. Print our stats, update waste maps and clear. */
+	    int byteUseCount = bytesUsed->count();
+
+	    /* We are being evicted. Print our stats, update waste counters and clear. */
 	    if(WANT_RAW_OUTPUT)
 	    {
-		cout << bytesUsed->count() << "\t" << timesReusedBeforeEvicted 
-		     << "\t" << accessSite << "[" << varInfo << "]\t" 
+		cout << byteUseCount << "\t" << timesReusedBeforeEvicted 
+		     << "\t" << site->accessSite << "[" << varInfo << "]\t" 
 		     << "0x" << hex << address << dec << endl;
 	    }
 
-	    if(timesReusedBeforeEvicted == 0)
-	    {
-		zeroReuseMap.insert(pair<string, ZeroReuseRecord>
-				    (accessSite, 
-				     ZeroReuseRecord(varInfo, address)));
-	    }
-	    if((float)(bytesUsed->count()) / (float)lineSize < LOW_UTIL_THRESHOLD)
-	    {
-		lowUtilMap.insert(pair<string, LowUtilRecord>
-				  (accessSite, 
-				   LowUtilRecord(varInfo, address, bytesUsed->count())));
-	    }
+	    bool zeroReuse = (timesReusedBeforeEvicted == 0);
+	    bool lowUtil = ((float)byteUseCount / (float)lineSize < LOW_UTIL_THRESHOLD);
+
+	    if(zeroReuse)
+		site->zeroReuse.add(ZeroReuseRecord(varInfo, address, byteUseCount));
 
+	    if(lowUtil)
+		site->lowUtil.add(LowUtilRecord(varInfo, address, byteUseCount));
+
+	    countWaste(owner, zeroReuse, lowUtil);
 
 	    address = 0;
 	    tag = 0;
-	    accessSite = "";
+	    site = NULL;
 	    varInfo = "";
 	    timesReusedBeforeEvicted = 0;
 	    bytesUsed->reset();
@@ -335,7 +534,7 @@ public:
      * Return true on a hit, false on a miss. 
      */
     bool access(size_t address, unsigned short accessSize, 
-		string accessSite, string varInfo)
+		SiteRecord *site, const string &varInfo)
 	{
 	    curTime++;
 
@@ -352,7 +551,7 @@ public:
 	     * See if there is an empty cache line or find someone to evict. 
 	     */
 	    CacheLine *line = findCleanOrVictim(curTime);
-	    line->setAndAccess(address, accessSize, accessSite, varInfo, curTime);
+	    line->setAndAccess(address, accessSize, site, varInfo, curTime);
 	    return false;
 	}
 
@@ -370,7 +569,7 @@ public:
     int assoc;
     int lineSize;
     CacheSet *sets;
-    int numMisses, numHits;
+    size_t numMisses, numHits;
 
 
     Cache(int ns, int as, int ls)
@@ -386,7 +585,7 @@ public:
 	}
 
     void access(size_t address, unsigned short accessSize, 
-		string accessSite, string varInfo)
+		SiteRecord *site, const string &varInfo)
 	{
 	    /* See if the access spans two cache lines.
 	     */
@@ -394,7 +593,7 @@ public:
 	    
 	    if(lineOffset + accessSize <= lineSize)
 	    {
-		__access(address, accessSize, accessSite, varInfo);
+		__access(address, accessSize, site, varInfo);
 		return;
 	    }
 
@@ -408,7 +607,7 @@ public:
 	    uint16_t sizeOfSpillingAccess = accessSize - bytesFittingIntoFirstLine;
 #if VERBOSE
 	    cerr << "SPANNING ACCESS: 0x" << hex << address 
-		 << dec << " " << accessSize << " " << accessSite 
+		 << dec << " " << accessSize << " " << site->accessSite 
 		 << " " << varInfo << endl;
 	    cerr << "Split into: " << endl;
 	    cerr << "\t0x" << hex << address << dec << " " 
@@ -419,12 +618,12 @@ public:
 
 
 	    /* Split them into two accesses */
-	    __access(address, bytesFittingIntoFirstLine, accessSite, varInfo);
+	    __access(address, bytesFittingIntoFirstLine, site, varInfo);
 
 	    /* We recursively call this function in case the spilling access 
 	     * spans more than two lines. */
 	    access(addressOfFirstByteNotFitting, sizeOfSpillingAccess, 
-		   accessSite, varInfo);
+		   site, varInfo);
 	    
 	}
 
@@ -446,7 +645,7 @@ private:
      * lines. The calling function should have taken care of this.
      */
     void __access(size_t address, unsigned short accessSize, 
-		string accessSite, string varInfo)
+		SiteRecord *site, const string &varInfo)
 	{
 	    /* Locate the set that we have to access */
 	    int setNum = (address >> (int)log2(lineSize)) % numSets;
@@ -455,11 +654,15 @@ private:
 #if VERBOSE
 	    cout << hex << address << dec << " maps into set #" << setNum << endl;
 #endif
-	    bool hit = sets[setNum].access(address, accessSize, accessSite, varInfo);
+	    bool hit = sets[setNum].access(address, accessSize, site, varInfo);
 	    if(hit)
 		numHits++;
 	    else
+	    {
 		numMisses++;
+		site->misses++;
+		countMiss();
+	    }
 	}
 
 };
@@ -467,68 +670,365 @@ private:
  * END CACHE SIMULATION CODE
 /****************************************************************************/
 
-void parseAndSimulate(string line, Cache *c)
+/***************************************************************************
+ * BEGIN TLB SIMULATION CODE
+/****************************************************************************/
+
+/* Default TLB parameters for a 64-entry 4-way set associative TLB.
+ * The TLB is only simulated if the user gives us at least one
+ * page size with the -P option. We simulate a separate TLB
+ * for every page size, so the user can see where huge pages 
+ * would pay off.
+ */
+int TLB_ENTRIES = 64;
+int TLB_ASSOC = 4;
+vector<size_t> TLB_PAGE_SIZES; /* in bytes */
+
+/* TLB statistics for one access site: how many TLB misses it caused, 
+ * and for the pages it brought into the TLB, how many distinct cache
+ * lines were touched in each page before the page was evicted from
+ * the TLB. 
+ */
+class TlbSiteStats
 {
-    istringstream str(line);
-    string word;
-    size_t address;
-    unsigned short accessSize;
-    string accessSite;
-    string varInfo;
+public:
+    size_t misses;
+    size_t pagesEvicted;
+    size_t linesTouched;  /* summed over all evicted pages */
 
-    /* Let's determine if this is an access record */
-    if(!str.eof())
-    {
-	str >> word;
-	if(!(word.compare("read:") == 0) && !(word.compare("write:") == 0))
-	    return;
-    }
+    TlbSiteStats()
+	: misses(0), pagesEvicted(0), linesTouched(0) {}
+};
 
-    /* We are assuming the memtracker trace output, the text 
-     * version. It has the following format:
-     * <access_type> <tid> <addr> <size> <func> <access_source> <alloc_source> <name> <type>
+class TlbEntry
+{
+public:
+    size_t page;        /* virtual page number */
+    size_t timeStamp;   /* virtual time of access, zero if the entry is clean */
+    SiteRecord *site;   /* the access site that brought the page into the TLB */
+    vector<bool> linesUsed; /* a bit for each cache line in the page
+			     * that was accessed while the page was in the TLB */
+    size_t numLinesUsed;
+
+    TlbEntry()
+	: page(0), timeStamp(0), site(NULL), numLinesUsed(0) {}
+};
+
+class Tlb
+{
+public:
+    size_t pageSize;
+    int numSets;
+    int assoc;
+    size_t linesPerPage;
+    TlbEntry *entries;   /* numSets * assoc entries, set by set */
+    size_t curTime;
+    size_t numMisses, numHits;
+    unordered_map<SiteRecord*, TlbSiteStats> siteStats;
+
+    Tlb(size_t ps, int numEntries, int as)
+	: pageSize(ps), assoc(as)
+	{
+	    numSets = numEntries / assoc;
+	    if(numSets < 1)
+		numSets = 1;
+	    linesPerPage = pageSize / CACHE_LINE_SIZE;
+	    entries = new TlbEntry[numSets * assoc];
+	    for(int i = 0; i < numSets * assoc; i++)
+		entries[i].linesUsed.resize(linesPerPage, false);
+	    curTime = 0;
+	    numMisses = 0;
+	    numHits = 0;
+	}
+
+    /* Mark every cache line touched by this access as used in the
+     * page that holds it. An access may span pages, in which case
+     * it counts as an access to each of them. 
      */
-    int iter = 1;
-    while(!str.eof())
-    {
-	str >> word;
+    void access(size_t address, unsigned short accessSize, SiteRecord *site)
+	{
+	    size_t firstLine = address / CACHE_LINE_SIZE;
+	    size_t lastLine = (address + max(accessSize, (unsigned short)1) - 1) 
+		/ CACHE_LINE_SIZE;
+	    TlbEntry *entry = NULL;
+
+	    for(size_t line = firstLine; line <= lastLine; line++)
+	    {
+		size_t page = line / linesPerPage;
 
-	switch(iter++)
+		if(entry == NULL || entry->page != page)
+		    entry = lookup(page, site);
+
+		size_t lineInPage = line % linesPerPage;
+		if(!entry->linesUsed[lineInPage])
+		{
+		    entry->linesUsed[lineInPage] = true;
+		    entry->numLinesUsed++;
+		}
+	    }
+	}
+
+    void printParams()
 	{
-	case 1:	    // Skip the tid
-	    break;
-	case 2:     // Parse the address
-	    address = strtol(word.c_str(), 0, 16);
-	    if(errno == EINVAL || errno == ERANGE)
+	    cout << "TLB page size      = " << pageSize/KILOBYTE << "K" << endl;
+	    cout << "TLB entries        = " << numSets * assoc << endl;
+	    cout << "TLB associativity  = " << assoc << endl;
+	}
+
+    void printStats()
+	{
+	    size_t pagesEvicted = 0, linesTouched = 0;
+
+	    for(auto it = siteStats.begin(); it != siteStats.end(); it++)
 	    {
-		cerr << "The following line caused error when parsing address: " << endl;
-		cerr << line << endl;
-		exit(-1);
+		pagesEvicted += it->second.pagesEvicted;
+		linesTouched += it->second.linesTouched;
 	    }
-	    break;
-	case 3:     // Parse the size
-	    accessSize = (unsigned short) strtol(word.c_str(), 0, 10);
-	    if(errno == EINVAL || errno == ERANGE)
+
+	    printParams();
+	    cout << "Number of TLB hits: " << numHits << endl;
+	    cout << "Number of TLB misses: " << numMisses << endl;
+	    if(pagesEvicted > 0)
+		cout << "Average page utilization: " 
+		     << (double)linesTouched / pagesEvicted << "/" << linesPerPage 
+		     << " lines" << endl;
+	}
+
+    /* Print per-site statistics in the order of decreasing TLB misses */
+    void printSiteStats()
+	{
+	    multimap<size_t, pair<SiteRecord*, TlbSiteStats*>> sorted;
+
+	    for(auto it = siteStats.begin(); it != siteStats.end(); it++)
+		sorted.insert(make_pair(it->second.misses, 
+					make_pair(it->first, &(it->second))));
+
+	    for(auto it = sorted.rbegin(); it != sorted.rend(); it++)
 	    {
-		cerr << "The following line caused error when parsing access size: " << endl;
-		cerr << line << endl;
-		exit(-1);
+		SiteRecord *sr = it->second.first;
+		TlbSiteStats *ts = it->second.second;
+
+		cout << it->first << " TLB misses" << endl;
+		cout << sr->accessSite << endl;
+		if(ts->pagesEvicted > 0)
+		    cout << "\t" << ts->pagesEvicted << " pages evicted, " 
+			 << (double)ts->linesTouched / ts->pagesEvicted << "/" 
+			 << linesPerPage << " lines used per page" << endl;
+		cout << endl;
+	    }
+	}
+
+private:
+    /* Find the entry for the page, or bring the page into the TLB,
+     * evicting the least recently used entry in the set if necessary.
+     */
+    TlbEntry * lookup(size_t page, SiteRecord *site)
+	{
+	    TlbEntry *set = &entries[(page % numSets) * assoc];
+	    TlbEntry *victim = &set[0];
+
+	    curTime++;
+
+	    for(int i = 0; i < assoc; i++)
+	    {
+		if(set[i].timeStamp != 0 && set[i].page == page)
+		{
+		    set[i].timeStamp = curTime;
+		    numHits++;
+		    return &set[i];
+		}
+		/* A clean entry has a timestamp of zero, 
+		 * so it will automatically get selected. */
+		if(set[i].timeStamp < victim->timeStamp)
+		    victim = &set[i];
 	    }
+
+	    numMisses++;
+	    siteStats[site].misses++;
+
+	    if(victim->timeStamp != 0)
+		evict(victim);
+
+	    victim->page = page;
+	    victim->timeStamp = curTime;
+	    victim->site = site;
+	    return victim;
+	}
+
+    void evict(TlbEntry *entry)
+	{
+	    TlbSiteStats &ts = siteStats[entry->site];
+
+	    ts.pagesEvicted++;
+	    ts.linesTouched += entry->numLinesUsed;
+
+	    fill(entry->linesUsed.begin(), entry->linesUsed.end(), false);
+	    entry->numLinesUsed = 0;
+	    entry->site = NULL;
+	}
+};
+
+vector<Tlb*> tlbs;
+
+/***************************************************************************
+ * END TLB SIMULATION CODE
+/****************************************************************************/
+
+/***************************************************************************
+ * BEGIN TRACE READING CODE
+/****************************************************************************/
+
+/* The largest number of words in an access record we care about. 
+ * <access_type> <tid> <addr> <size> <func> <access_source> <alloc_source> <name> <type>
+ */
+#define MAX_WORDS 9
+
+/* How much we ask stdio to buffer when reading the trace */
+#define TRACE_BUFFER_SIZE (1024*1024)
+
+/* 
+ * Break up the line into whitespace-separated words in place, 
+ * without copying them. Return the number of words found, but
+ * no more than maxWords. 
+ */
+int splitWords(char *line, char **words, int maxWords)
+{
+    int numWords = 0;
+    char *pos = line;
+
+    while(numWords < maxWords)
+    {
+	while(*pos != '\0' && isspace(*pos))
+	    pos++;
+	if(*pos == '\0')
 	    break;
-	case 4: 
-	case 5: 
-	    accessSite += word + " ";
+
+	words[numWords++] = pos;
+
+	while(*pos != '\0' && !isspace(*pos))
+	    pos++;
+	if(*pos == '\0')
 	    break;
-	case 6: 
-	case 7: 
-	case 8:
-	    varInfo += word + " ";
+	*pos++ = '\0';
+    }
+    return numWords;
+}
+
+/* Print a line broken up by splitWords, for the error messages */
+void printWords(char **words, int numWords)
+{
+    for(int i = 0; i < numWords; i++)
+	cerr << (i > 0 ? " " : "") << words[i];
+}
+
+/* Keep track of the functions each thread is in, so we know
+ * which phase its accesses belong to. 
+ */
+void parseFunctionRecord(const char *event, int tid, const char *funcName)
+{
+    vector<int> &stack = threadFuncStacks[tid];
+    int phase = findPhase(funcName);
+
+    if(strcmp(event, "function-begin:") == 0)
+    {
+	stack.push_back(phase);
+	return;
+    }
+
+    /* Pop the function off the stack. If we missed the end records
+     * of the functions it called (e.g., they were exited via longjmp),
+     * pop those as well. If we never saw the function begin, ignore it.
+     */
+    for(size_t i = stack.size(); i > 0; i--)
+    {
+	if(stack[i-1] == phase)
+	{
+	    stack.resize(i-1);
 	    break;
 	}
     }
+}
+
+void parseAndSimulate(char *line, Cache *c)
+{
+    char *words[MAX_WORDS];
+    char *endptr;
+    size_t address;
+    unsigned short accessSize;
+
+    /* We keep these around between calls, so we don't allocate
+     * memory for every record we parse. */
+    static string accessSite;
+    static string varInfo;
+
+    int numWords = splitWords(line, words, MAX_WORDS);
+
+    if(numWords == 0)
+	return;
+
+    /* Function delimiter records have the following format:
+     * <function-begin:|function-end:> <tid> <func>
+     */
+    if(strcmp(words[0], "function-begin:") == 0 || 
+       strcmp(words[0], "function-end:") == 0)
+    {
+	if(numWords < 3)
+	    return;
+	parseFunctionRecord(words[0], atoi(words[1]), words[2]);
+	return;
+    }
+
+    /* Let's determine if this is an access record */
+    if(strcmp(words[0], "read:") != 0 && strcmp(words[0], "write:") != 0)
+	return;
+
+    /* We are assuming the memtracker trace output, the text 
+     * version. It has the following format:
+     * <access_type> <tid> <addr> <size> <func> <access_source> <alloc_source> <name> <type>
+     */
+    if(numWords < 4)
+    {
+	cerr << "The following record is truncated: " << endl;
+	printWords(words, numWords);
+	cerr << endl;
+	exit(-1);
+    }
+
+    beginAccess(atoi(words[1]));
+
+    address = strtoull(words[2], &endptr, 16);
+    if(endptr == words[2])
+    {
+	cerr << "The following line caused error when parsing address: " << endl;
+	printWords(words, numWords);
+	cerr << " " << words[2] << endl;
+	exit(-1);
+    }
+
+    accessSize = (unsigned short) strtoul(words[3], &endptr, 10);
+    if(endptr == words[3])
+    {
+	cerr << "The following line caused error when parsing access size: " << endl;
+	printWords(words, numWords);
+	cerr << " " << words[3] << endl;
+	exit(-1);
+    }
+
+    accessSite.clear();
+    for(int i = 4; i < 6 && i < numWords; i++)
+    {
+	accessSite += words[i];
+	accessSite += " ";
+    }
+
+    varInfo.clear();
+    for(int i = 6; i < numWords; i++)
+    {
+	varInfo += words[i];
+	varInfo += " ";
+    }
 
 #if VERBOSE
-    cout << line << endl;
     cout << "Parsed: " << endl;
     cout << hex << "0x" << address << dec << endl;
     cout << accessSize << endl;
@@ -536,85 +1036,530 @@ void parseAndSimulate(string line, Cache *c)
     cout << varInfo << endl;
 #endif
 
-    c->access(address, accessSize, accessSite, varInfo);
+    SiteRecord *site = findSiteRecord(accessSite);
+    site->accesses++;
+
+    c->access(address, accessSize, site, varInfo);
+
+    for(Tlb *tlb: tlbs)
+	tlb->access(address, accessSize, site);
+
+}
+
+/* 
+ * Decompressors for the compressed trace formats we recognize,
+ * identified by the magic bytes at the beginning of the file. 
+ * Memtracker writes its trace to stdout, and the users often
+ * pipe it through a compressor to save space. 
+ */
+struct Decompressor
+{
+    const char *magic;
+    size_t magicLen;
+    const char *command;
+};
+
+Decompressor decompressors[] = {
+    {"\x1f\x8b", 2, "gzip -dc"},
+    {"BZh", 3, "bzip2 -dc"},
+    {"\xfd" "7zXZ", 6, "xz -dc"},
+    {"\x28\xb5\x2f\xfd", 4, "zstd -dc"},
+};
+
+/*
+ * Run 'command' on the first headLen bytes of the trace, which we
+ * already read from f, followed by the rest of f. A child process
+ * writes them into a pipe which the command reads as its stdin, so
+ * this works on a trace we cannot go back in, like a pipe from a
+ * running memtracker. The caller must not read from f any more.
+ */
+FILE *pipeThrough(const char *command, FILE *f, const char *head, size_t headLen)
+{
+    int fds[2];
+    pid_t pid;
+
+    if(pipe(fds) != 0)
+	return NULL;
+
+    pid = fork();
+    if(pid < 0)
+	return NULL;
+    if(pid == 0)
+    {
+	/* The feeder is left to init, so nobody has to wait for it */
+	if(fork() != 0)
+	    _exit(0);
+	close(fds[0]);
+
+	char buf[64 * 1024];
+	size_t len = headLen;
+	memcpy(buf, head, headLen);
+	do
+	{
+	    for(size_t done = 0; done < len; )
+	    {
+		ssize_t n = write(fds[1], buf + done, len - done);
+		if(n < 0 && errno != EINTR)
+		    _exit(1);
+		if(n > 0)
+		    done += n;
+	    }
+	    len = fread(buf, 1, sizeof(buf), f);
+	}
+	while(len > 0);
+	_exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    close(fds[1]);
+
+    /* The command's stdin is the read end of the pipe */
+    string cmd = string(command) + " <&" + to_string(fds[0]);
+    FILE *out = popen(cmd.c_str(), "r");
+    close(fds[0]);
+    return out;
+}
+
+/*
+ * Open the trace for reading. If the file name is "-", we read
+ * from stdin, so the simulator can be put at the end of a pipe 
+ * with a running memtracker. If the trace is compressed, we read
+ * it through the corresponding decompressor. Return NULL on error.
+ * Set isPipe to true if the returned file must be closed with pclose.
+ *
+ * We look at the magic bytes at the beginning of a regular file and
+ * go back. We cannot go back in a pipe or a FIFO, so there we only
+ * peek at the first byte, which never starts a compressed trace
+ * unless it is the first byte of one of the magics: only then we
+ * read the rest of the magic and feed the trace through pipeThrough,
+ * to the decompressor or to cat.
+ */
+FILE *openTrace(const char *fname, bool *isPipe)
+{
+    FILE *f;
+    char magic[8];
+    size_t magicLen;
+    struct stat st;
+    Decompressor *found = NULL;
+
+    *isPipe = false;
+
+    if(strcmp(fname, "-") == 0)
+	f = stdin;
+    else
+	f = fopen(fname, "r");
+    if(f == NULL)
+	return NULL;
+
+    /* Must come before any I/O on the stream */
+    setvbuf(f, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+    bool regular = fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode);
 
+    if(!regular)
+    {
+	int c = getc(f);
+	if(c == EOF)
+	    return f;
+	ungetc(c, f);
+
+	bool candidate = false;
+	for(Decompressor &d: decompressors)
+	    candidate = candidate || c == (unsigned char)d.magic[0];
+	if(!candidate)
+	    return f;
+    }
+
+    magicLen = fread(magic, 1, sizeof(magic), f);
+    for(Decompressor &d: decompressors)
+    {
+	if(magicLen >= d.magicLen && memcmp(magic, d.magic, d.magicLen) == 0)
+	{
+	    found = &d;
+	    break;
+	}
+    }
+
+    if(regular)
+    {
+	if(found == NULL)
+	{
+	    if(fseek(f, 0, SEEK_SET) != 0)
+		return NULL;
+	    return f;
+	}
+
+	fclose(f);
+
+	/* Quote the file name for the shell */
+	string cmd = string(found->command) + " '";
+	for(const char *p = fname; *p != '\0'; p++)
+	{
+	    if(*p == '\'')
+		cmd += "'\\''";
+	    else
+		cmd += *p;
+	}
+	cmd += "'";
+
+	cout << "Reading compressed trace with: " << cmd << endl;
+	f = popen(cmd.c_str(), "r");
+    }
+    else
+    {
+	if(found)
+	    cout << "Reading compressed trace with: " << found->command << endl;
+	FILE *in = f;
+	f = pipeThrough(found ? found->command : "cat", in, magic, magicLen);
+	if(in != stdin)
+	    fclose(in);
+    }
+
+    if(f == NULL)
+	return NULL;
+    *isPipe = true;
+    setvbuf(f, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    return f;
 }
 
+/***************************************************************************
+ * END TRACE READING CODE
+/****************************************************************************/
+
 /***************************************************************************
  * BEGIN DATA ANALYSIS CODE
 /****************************************************************************/
 
 /*
- * These functions summarize the maps of waste records, so we can 
+ * These functions summarize the waste counters, so we can 
  * display them in a user-friendly way. We will group the records
  * by source code line(access site) and display them in the order of decreasing
  * waste occurrences.
  */
 template <class T>
-void summarizeWasteMap(unordered_multimap<string, T> &ungroupedMap,
-		       multimap<int, tuple<string, vector<T>>> &groupedMap)
+void summarizeWasteMap(WasteSummary<T> SiteRecord::*summary,
+		       multimap<size_t, SiteRecord*> &groupedMap)
 {
+    for(auto it = siteMap.begin(); it != siteMap.end(); it++) 
+    {
+	SiteRecord *sr = &(it->second);
 
-    /* Iterate the map. Once we encounter a new source line,
-     * count the number of its associated waste records, 
-     * put that in the summarized map, where the count is the key, 
-     * and the value is the list (vector) of associated waste records.
-     */
-    for(auto it = ungroupedMap.begin(); it != ungroupedMap.end(); it++) 
+	if((sr->*summary).count > 0)
+	    groupedMap.insert(make_pair((sr->*summary).count, sr));
+    }
+}
+
+template <class T>
+void printSummarizedMap(WasteSummary<T> SiteRecord::*summary,
+			multimap<size_t, SiteRecord*> &groupedMap)
+{
+    for(auto it = groupedMap.rbegin(); it != groupedMap.rend(); it++) 
     {
+	SiteRecord *sr = it->second;
+	WasteSummary<T> &ws = sr->*summary;
 
-	vector<T> curVector;	
-	string curAccessSite = it->first;
+        cout << it->first << " waste occurrences" << endl;
+        cout << sr->accessSite << endl;
+
+	cout << "\tbytes used:";
+	for(size_t i = 0; i < ws.byteUseHist.size(); i++)
+	    if(ws.byteUseHist[i] > 0)
+		cout << " " << i << "/" << CACHE_LINE_SIZE << "=" << ws.byteUseHist[i];
+	cout << endl;
 
-	do 
+	cout << "\t" << ws.samples.size() << " sampled occurrences:" << endl;
+	for(size_t i = 0; i < ws.samples.size(); i++)
+	    cout << ws.samples[i] << endl;
+    }
+}
+
+void printBreakdownHeader(const char *what)
+{
+    cout << setw(30) << what << " "
+	 << setw(12) << "Accesses" << " "
+	 << setw(12) << "Misses" << " "
+	 << setw(10) << "Miss rate" << " "
+	 << setw(12) << "Zero reuse" << " "
+	 << setw(12) << "Low util" << endl;
+}
+
+void printBreakdown(const string &what, const BreakdownStats &bs)
+{
+    cout << setw(30) << what << " "
+	 << setw(12) << bs.accesses << " "
+	 << setw(12) << bs.misses << " "
+	 << setw(10) << fixed << setprecision(4)
+	 << (bs.accesses ? (double)bs.misses / bs.accesses : 0.0) << " "
+	 << setw(12) << bs.zeroReuse << " "
+	 << setw(12) << bs.lowUtil << endl;
+    cout.unsetf(ios::floatfield);
+}
+
+/* Print the phases in the order of decreasing misses */
+void printPhaseBreakdown()
+{
+    multimap<size_t, int> sorted;
+
+    for(size_t i = 0; i < phaseStats.size(); i++)
+	if(phaseStats[i].accesses > 0 || phaseStats[i].zeroReuse > 0 ||
+	   phaseStats[i].lowUtil > 0)
+	    sorted.insert(make_pair(phaseStats[i].misses, i));
+
+    printBreakdownHeader("Function");
+    for(auto it = sorted.rbegin(); it != sorted.rend(); it++)
+	printBreakdown(phaseNames[it->second], phaseStats[it->second]);
+}
+
+/***************************************************************************
+ * END DATA ANALYSIS CODE
+/****************************************************************************/
+
+/***************************************************************************
+ * BEGIN REPORT CODE
+/****************************************************************************/
+
+/*
+ * Besides the human-readable output, we can write a CSV report with 
+ * a row of counters per access site, which can be compared across builds.
+ * Given two such reports, the diff mode ranks the access sites by 
+ * the change in waste (zero reuse plus low utilization occurrences). 
+ */
+
+/* Quote the field if it contains characters that have a meaning in CSV */
+string csvQuote(const string &field)
+{
+    if(field.find_first_of(",\"\n") == string::npos)
+	return field;
+
+    string quoted = "\"";
+    for(char ch: field)
+    {
+	if(ch == '"')
+	    quoted += '"';
+	quoted += ch;
+    }
+    return quoted + "\"";
+}
+
+/* Split a CSV line into fields, undoing the quoting done by csvQuote */
+vector<string> csvSplit(const string &line)
+{
+    vector<string> fields(1);
+    bool inQuotes = false;
+
+    for(size_t i = 0; i < line.length(); i++)
+    {
+	char ch = line[i];
+
+	if(inQuotes)
 	{
-	    curVector.push_back(it->second);
-	    ++it;
-	} while (it != ungroupedMap.end() && curAccessSite.compare(it->first)==0);
-	
-	tuple<string, vector<T>> gRecs = make_tuple(curAccessSite, curVector); 
-	groupedMap.insert(make_pair(curVector.size(), gRecs));	
+	    if(ch == '"' && i + 1 < line.length() && line[i+1] == '"')
+	    {
+		fields.back() += '"';
+		i++;
+	    }
+	    else if(ch == '"')
+		inQuotes = false;
+	    else
+		fields.back() += ch;
+	}
+	else if(ch == '"')
+	    inQuotes = true;
+	else if(ch == ',')
+	    fields.push_back("");
+	else if(ch != '\r')
+	    fields.back() += ch;
+    }
+    return fields;
+}
+
+void writeCSVReport(const char *fname)
+{
+    ofstream report(fname);
+
+    if(!report.is_open())
+    {
+	cerr << "Failed to open file " << fname << " for the CSV report." << endl;
+	exit(-1);
+    }
+
+    report << "site,accesses,misses,zero_reuse,low_util,low_util_bytes_used";
+    for(Tlb *tlb: tlbs)
+	report << ",tlb_misses_" << tlb->pageSize/KILOBYTE << "K"
+	       << ",tlb_pages_evicted_" << tlb->pageSize/KILOBYTE << "K"
+	       << ",tlb_lines_used_" << tlb->pageSize/KILOBYTE << "K";
+    report << endl;
 
-	if(it == ungroupedMap.end())
-	  break;
+    /* Sort the rows by site, so reports from different runs
+     * can also be compared with the usual text tools. */
+    map<string, SiteRecord*> sorted;
+    for(auto it = siteMap.begin(); it != siteMap.end(); it++)
+	sorted[it->first] = &(it->second);
+
+    for(auto it = sorted.begin(); it != sorted.end(); it++)
+    {
+	SiteRecord &sr = *(it->second);
+	size_t lowUtilBytes = 0;
+
+	for(size_t i = 0; i < sr.lowUtil.byteUseHist.size(); i++)
+	    lowUtilBytes += i * sr.lowUtil.byteUseHist[i];
+
+	report << csvQuote(sr.accessSite) << "," << sr.accesses << "," 
+	       << sr.misses << "," << sr.zeroReuse.count << "," 
+	       << sr.lowUtil.count << "," << lowUtilBytes;
+
+	for(Tlb *tlb: tlbs)
+	{
+	    TlbSiteStats ts;
+	    auto tsIt = tlb->siteStats.find(&sr);
+	    if(tsIt != tlb->siteStats.end())
+		ts = tsIt->second;
+	    report << "," << ts.misses << "," << ts.pagesEvicted 
+		   << "," << ts.linesTouched;
+	}
+	report << endl;
     }
+
+    report.close();
+    cout << "CSV report written to " << fname << endl;
 }
 
-template <class T>
-void printSummarizedMap(multimap<int, tuple<string, vector<T>>> & groupedMap)
+/* The counters from a CSV report that we compare in the diff mode */
+class ReportRow
 {
-    for(auto it = groupedMap.rbegin(); it != groupedMap.rend(); it++) 
+public:
+    size_t accesses;
+    size_t misses;
+    size_t waste;
+
+    ReportRow()
+	: accesses(0), misses(0), waste(0) {}
+};
+
+void readCSVReport(const char *fname, unordered_map<string, ReportRow> &rows)
+{
+    ifstream report(fname);
+    string line;
+    int siteCol = -1, accessesCol = -1, missesCol = -1, zeroCol = -1, lowCol = -1;
+
+    if(!report.is_open())
     {
-        cout << it->first << " waste occurrences" << endl;
+	cerr << "Failed to open CSV report " << fname << endl;
+	exit(-1);
+    }
+
+    /* Find the columns we need by their names in the header */
+    getline(report, line);
+    vector<string> header = csvSplit(line);
+    for(size_t i = 0; i < header.size(); i++)
+    {
+	if(header[i] == "site")
+	    siteCol = i;
+	else if(header[i] == "accesses")
+	    accessesCol = i;
+	else if(header[i] == "misses")
+	    missesCol = i;
+	else if(header[i] == "zero_reuse")
+	    zeroCol = i;
+	else if(header[i] == "low_util")
+	    lowCol = i;
+    }
+    if(siteCol < 0 || accessesCol < 0 || missesCol < 0 || zeroCol < 0 || lowCol < 0)
+    {
+	cerr << fname << " does not look like a CSV report produced by this tool." 
+	     << endl;
+	exit(-1);
+    }
 
-	tuple<string, vector<T>> gRecs = it->second;
+    while(getline(report, line))
+    {
+	if(line.empty())
+	    continue;
+
+	vector<string> fields = csvSplit(line);
+	if(fields.size() < header.size())
+	{
+	    cerr << "Malformed line in " << fname << ": " << line << endl;
+	    exit(-1);
+	}
 
-	string accessSite = get<0>(gRecs); 
-	vector<T> recs = get<1>(gRecs); 
+	ReportRow &row = rows[fields[siteCol]];
+	row.accesses += strtoull(fields[accessesCol].c_str(), NULL, 10);
+	row.misses += strtoull(fields[missesCol].c_str(), NULL, 10);
+	row.waste += strtoull(fields[zeroCol].c_str(), NULL, 10) + 
+	    strtoull(fields[lowCol].c_str(), NULL, 10);
+    }
+}
 
-        cout << accessSite << endl;
-	for(int i = 0; i < recs.size(); i++)
-	    cout << recs[i] << endl;
+/* 
+ * Compare two CSV reports and print, as CSV, the sites in the order
+ * of decreasing absolute change in waste. The first row is the
+ * total over all sites.
+ */
+void diffCSVReports(const char *oldFname, const char *newFname)
+{
+    unordered_map<string, ReportRow> oldRows, newRows;
+    multimap<long long, string> sorted;
+    ReportRow oldTotal, newTotal;
+
+    readCSVReport(oldFname, oldRows);
+    readCSVReport(newFname, newRows);
+
+    /* Sites that are present in only one report are compared
+     * against zero counters. */
+    for(auto it = oldRows.begin(); it != oldRows.end(); it++)
+	newRows[it->first];
+    for(auto it = newRows.begin(); it != newRows.end(); it++)
+    {
+	ReportRow &o = oldRows[it->first];
+	ReportRow &n = it->second;
+
+	oldTotal.accesses += o.accesses;
+	oldTotal.misses += o.misses;
+	oldTotal.waste += o.waste;
+	newTotal.accesses += n.accesses;
+	newTotal.misses += n.misses;
+	newTotal.waste += n.waste;
+
+	sorted.insert(make_pair(llabs((long long)n.waste - (long long)o.waste), 
+				it->first));
     }
+
+    cout << "site,old_waste,new_waste,waste_change,"
+	 << "old_misses,new_misses,misses_change,old_accesses,new_accesses" << endl;
+
+    auto printRow = [](const string &site, const ReportRow &o, const ReportRow &n)
+	{
+	    cout << csvQuote(site) << "," 
+		 << o.waste << "," << n.waste << "," 
+		 << (long long)n.waste - (long long)o.waste << ","
+		 << o.misses << "," << n.misses << "," 
+		 << (long long)n.misses - (long long)o.misses << ","
+		 << o.accesses << "," << n.accesses << endl;
+	};
+
+    printRow("<total>", oldTotal, newTotal);
+    for(auto it = sorted.rbegin(); it != sorted.rend(); it++)
+	printRow(it->second, oldRows[it->second], newRows[it->second]);
 }
 
 /***************************************************************************
- * END DATA ANALYSIS CODE
+ * END REPORT CODE
 /****************************************************************************/
 
 int main(int argc, char *argv[])
 {
     char *fname = NULL;
+    char *csvFname = NULL;
+    char *diffFname = NULL;
     char *nptr;
     char c;
-    ifstream traceFile;
 
     
     /* Right now we don't check that the number of sets
      * and the cache line size are a power of two, but
      * we probably should. 
      */
-    while ((c = getopt (argc, argv, "a:f:l:s:r")) != -1)
+    while ((c = getopt (argc, argv, "a:b:c:d:e:f:l:s:rP:T:W:")) != -1)
 	switch(c)
 	{
 	case 'a': /* Associativity */
@@ -628,6 +1573,35 @@ int main(int argc, char *argv[])
 	    else
 		cout << "Associativity set to "<< ASSOC << endl;
 	    break;
+	case 'b': /* Number of access records per time series bucket */
+	    TIME_BUCKET_SIZE = (size_t)strtoul(optarg, &nptr, 10);
+	    if(nptr == optarg || TIME_BUCKET_SIZE == 0)
+	    {
+		cerr << "Invalid argument for the time series bucket size: " 
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    else
+		cout << "Time series bucket size set to "<< TIME_BUCKET_SIZE 
+		     << " access records" << endl;
+	    break;
+	case 'c': /* Write the CSV report into this file */
+	    csvFname = optarg;
+	    break;
+	case 'd': /* Diff mode: compare this CSV report with the next argument */
+	    diffFname = optarg;
+	    break;
+	case 'e': /* Number of example records kept per access site */
+	    SAMPLE_SIZE = (int)strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || SAMPLE_SIZE < 0)
+	    {
+		cerr << "Invalid argument for the number of examples per site: " 
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    else
+		cout << "Examples per site set to "<< SAMPLE_SIZE << endl;
+	    break;
 	case 'f':
 	    fname = optarg;
 	    break;
@@ -645,6 +1619,42 @@ int main(int argc, char *argv[])
 	case 'r':
 	    WANT_RAW_OUTPUT = true;
 	    break;
+	case 'P': /* TLB page size in KB, can be given more than once */
+	{
+	    long pageSizeKB = strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || pageSizeKB <= 0 || 
+	       (pageSizeKB & (pageSizeKB - 1)) != 0)
+	    {
+		cerr << "Invalid argument for the TLB page size " 
+		     << "(must be a power of two in KB): " << optarg << endl;
+		exit(-1);
+	    }
+	    TLB_PAGE_SIZES.push_back((size_t)pageSizeKB * KILOBYTE);
+	    cout << "Simulating TLB with page size "<< pageSizeKB << "K" << endl;
+	    break;
+	}
+	case 'T': /* Number of TLB entries */
+	    TLB_ENTRIES = (int)strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || TLB_ENTRIES <= 0)
+	    {
+		cerr << "Invalid argument for the number of TLB entries: " 
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    else
+		cout << "Number of TLB entries set to "<< TLB_ENTRIES << endl;
+	    break;
+	case 'W': /* TLB associativity */
+	    TLB_ASSOC = (int)strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || TLB_ASSOC <= 0)
+	    {
+		cerr << "Invalid argument for TLB associativity: " 
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    else
+		cout << "TLB associativity set to "<< TLB_ASSOC << endl;
+	    break;
 	case 's': /* Number of cache sets */
     	    NUM_SETS = (int)strtol(optarg, &nptr, 10);
 	    if(nptr == optarg && NUM_SETS == 0)
@@ -663,73 +1673,127 @@ int main(int argc, char *argv[])
 	}
 
 
+    if(diffFname != NULL)
+    {
+	if(optind >= argc)
+	{
+	    cerr << "Please provide the second CSV report to compare against "
+		 << diffFname << "." << endl;
+	    exit(-1);
+	}
+	diffCSVReports(diffFname, argv[optind]);
+	return 0;
+    }
+
     if(fname == NULL)
     {
-	cerr << "Please provide input trace file with the -f option." << endl;
+	cerr << "Please provide input trace file with the -f option "
+	     << "(use \"-f -\" to read the trace from stdin)." << endl;
 	exit(-1);
     }
 
     Cache *cache = new Cache(NUM_SETS, ASSOC, CACHE_LINE_SIZE);
     cache->printParams();
+
+    for(size_t pageSize: TLB_PAGE_SIZES)
+    {
+	if(pageSize < (size_t)CACHE_LINE_SIZE)
+	{
+	    cerr << "TLB page size " << pageSize << " is smaller than "
+		 << "the cache line size." << endl;
+	    exit(-1);
+	}
+	Tlb *tlb = new Tlb(pageSize, TLB_ENTRIES, TLB_ASSOC);
+	tlb->printParams();
+	tlbs.push_back(tlb);
+    }
  
     /* Let's open the trace file */
-    traceFile.open(fname);
-    if(!traceFile.is_open())
+    bool isPipe;
+    FILE *traceFile = openTrace(fname, &isPipe);
+    if(traceFile == NULL)
     {
 	cerr << "Failed to open file " << fname << endl;
 	exit(-1);
     }
 
-    string line;
+    char *line = NULL;
+    size_t len = 0;
 
     /* Read the input line by line */
-    while(!traceFile.eof())
-    {
-	getline(traceFile, line);
+    while(getline(&line, &len, traceFile) != -1)
 	parseAndSimulate(line, cache);
+
+    free(line);
+    if(isPipe)
+    {
+	if(pclose(traceFile) != 0)
+	{
+	    cerr << "Decompressing the trace " << fname << " failed." << endl;
+	    exit(-1);
+	}
     }
+    else if(traceFile != stdin)
+	fclose(traceFile);
     
-    /* Print the waste maps */
+    /* Lines that are still in the cache have not generated waste yet,
+     * we only report evicted lines. */
+    multimap<size_t, SiteRecord*> groupedZeroReuseMap;
+    multimap<size_t, SiteRecord*> groupedLowUtilMap;
+
+    summarizeWasteMap(&SiteRecord::zeroReuse, groupedZeroReuseMap);
     cout << "*************************************************" << endl;
-    cout << "               ZERO REUSE MAP                    " << endl;
+    cout << "         ZERO REUSE MAP SUMMARIZED               " << endl;
     cout << "*************************************************" << endl;
+    printSummarizedMap(&SiteRecord::zeroReuse, groupedZeroReuseMap);
 
-    for(auto it = zeroReuseMap.begin(); it != zeroReuseMap.end(); it++) 
-    {
-        cout << it->first << endl;
-        cout << (ZeroReuseRecord&) it->second << endl;
-
-    }
-
+    summarizeWasteMap(&SiteRecord::lowUtil, groupedLowUtilMap);
     cout << endl;
-    
-    /* Print the waste maps */
     cout << "*************************************************" << endl;
-    cout << "               LOW UTILIZATION MAP               " << endl;
+    cout << "         LOW UTILIZATION MAP SUMMARIZED          " << endl;
     cout << "*************************************************" << endl;
+    printSummarizedMap(&SiteRecord::lowUtil, groupedLowUtilMap);
 
-    for(auto it = lowUtilMap.begin(); it != lowUtilMap.end(); it++) 
-    {
-        cout << it->first << endl;
-        cout << (LowUtilRecord&)it->second << endl;
-
-    }
-
-    summarizeWasteMap<ZeroReuseRecord>(zeroReuseMap, groupedZeroReuseMap);
+    cout << endl;
     cout << "*************************************************" << endl;
-    cout << "         ZERO REUSE MAP SUMMARIZED               " << endl;
+    cout << "         PER-THREAD BREAKDOWN                    " << endl;
     cout << "*************************************************" << endl;
-    printSummarizedMap<ZeroReuseRecord>(groupedZeroReuseMap);
+    printBreakdownHeader("Thread");
+    for(auto it = threadStats.begin(); it != threadStats.end(); it++)
+	printBreakdown(to_string(it->first), it->second);
 
-    summarizeWasteMap<LowUtilRecord>(lowUtilMap, groupedLowUtilMap);
     cout << endl;
     cout << "*************************************************" << endl;
-    cout << "         LOW UTILIZATION MAP SUMMARIZED          " << endl;
+    cout << "         PER-FUNCTION BREAKDOWN                  " << endl;
     cout << "*************************************************" << endl;
-    printSummarizedMap<LowUtilRecord>(groupedLowUtilMap);
-
-}
+    printPhaseBreakdown();
 
+    if(TIME_BUCKET_SIZE > 0)
+    {
+	cout << endl;
+	cout << "*************************************************" << endl;
+	cout << "         TIME SERIES                             " << endl;
+	cout << "*************************************************" << endl;
+	printBreakdownHeader("First access record");
+	for(size_t i = 0; i < timeSeries.size(); i++)
+	    printBreakdown(to_string(i * TIME_BUCKET_SIZE), timeSeries[i]);
+    }
 
+    if(csvFname != NULL)
+    {
+	cout << endl;
+	writeCSVReport(csvFname);
+    }
 
+    for(Tlb *tlb: tlbs)
+    {
+	cout << endl;
+	cout << "*************************************************" << endl;
+	cout << "         TLB MAP (" << tlb->pageSize/KILOBYTE << "K PAGES)" << endl;
+	cout << "*************************************************" << endl;
+	tlb->printStats();
+	cout << endl;
+	tlb->printSiteStats();
+    }
 
+}
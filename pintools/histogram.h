@@ -0,0 +1,102 @@
+/// Log-linear latency histogram in the spirit of HdrHistogram. Values
+/// below 32 are counted exactly, larger ones in buckets 1/16 of their
+/// power of two wide, so any 64-bit value is kept within 1/16 of its
+/// size in a fixed array of 976 counters. Recording is a few
+/// instructions and never allocates.
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+
+class LatencyHistogram {
+public:
+	enum {
+		SUB_BITS = 5,
+		SUB_COUNT = 1 << SUB_BITS,		// exact values
+		HALF_COUNT = SUB_COUNT / 2,		// buckets per power of two above
+		BUCKETS = (64 - SUB_BITS + 2) * HALF_COUNT
+	};
+
+	LatencyHistogram() { reset(); }
+
+	void reset() {
+		memset(_counts, 0, sizeof(_counts));
+		_count = _sum = _max = 0;
+	}
+
+	void record(const uint64_t value) {
+		++_counts[index(value)];
+		++_count;
+		_sum += value;
+		if (value > _max)
+			_max = value;
+	}
+
+	void add(const LatencyHistogram& other) {
+		for (unsigned i = 0; i < BUCKETS; ++i)
+			_counts[i] += other._counts[i];
+		_count += other._count;
+		_sum += other._sum;
+		if (other._max > _max)
+			_max = other._max;
+	}
+
+	// Leaves what was recorded since 'earlier', a copy of this histogram
+	// taken before. The max is then only known to the bucket.
+	void subtract(const LatencyHistogram& earlier) {
+		_max = 0;
+		for (unsigned i = 0; i < BUCKETS; ++i) {
+			_counts[i] -= earlier._counts[i];
+			if (_counts[i])
+				_max = highest(i);
+		}
+		_count -= earlier._count;
+		_sum -= earlier._sum;
+	}
+
+	uint64_t count() const { return _count; }
+	uint64_t sum() const { return _sum; }
+	uint64_t max() const { return _max; }
+
+	// Value at or below which 'percent' of the recorded values are, as
+	// the top of its bucket (never above the max).
+	uint64_t percentile(const double percent) const {
+		if (0 == _count)
+			return 0;
+		uint64_t rank = (uint64_t)ceil(percent / 100.0 * _count);
+		if (rank < 1)
+			rank = 1;
+		if (rank > _count)
+			rank = _count;
+		uint64_t seen = 0;
+		for (unsigned i = 0; i < BUCKETS; ++i) {
+			seen += _counts[i];
+			if (seen >= rank)
+				return highest(i) < _max ? highest(i) : _max;
+		}
+		return _max;
+	}
+
+	static unsigned index(const uint64_t value) {
+		if (value < SUB_COUNT)
+			return (unsigned)value;
+		const unsigned shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+		return (shift + 1) * HALF_COUNT + (unsigned)(value >> shift) - HALF_COUNT;
+	}
+
+	// The largest value counted in bucket 'i'
+	static uint64_t highest(const unsigned i) {
+		if (i < SUB_COUNT)
+			return i;
+		const unsigned shift = i / HALF_COUNT - 1;
+		const uint64_t sub = i % HALF_COUNT + HALF_COUNT;
+		return ((sub + 1) << shift) - 1;
+	}
+
+private:
+	uint64_t _counts[BUCKETS];
+	uint64_t _count;
+	uint64_t _sum;
+	uint64_t _max;
+};
@@ -167,6 +167,17 @@ KNOB<bool> KnobTrackStackAccesses(KNOB_MODE_WRITEONCE, "pintool",
 				  "s", "false", "Include stack memory accesses into the "
 				  "trace. Default is false. ");
 
+KNOB<string> KnobVarInfoCache(KNOB_MODE_WRITEONCE, "pintool",
+			      "c", "", "Directory where the variable and type "
+			      "information extracted from the debug info of "
+			      "every image is cached between runs. Default: "
+			      "no cache.");
+
+KNOB<bool> KnobVarInfoLazy(KNOB_MODE_WRITEONCE, "pintool",
+			   "l", "false", "Parse the debug info of a compilation "
+			   "unit only when a variable of one of its source files "
+			   "is first looked up. Default is false.");
+
 
 
 
@@ -1143,73 +1154,94 @@ VOID recordMemoryAccess(ADDRINT addr, UINT32 size, ADDRINT codeAddr,
 
     }
     
-    PIN_GetLock(&lock, PIN_ThreadId()+1);
+    string filename;
+    INT32 column = 0, line = 0;
+    string source = "<unknown>";
+    string name;
+
+    PIN_LockClient();
+    name = RTN_FindNameByAddress((ADDRINT)rtnAddr);
+    PIN_GetSourceLocation(codeAddr, &column, &line, &filename);
+    PIN_UnlockClient();
+
+    if(filename.length() > 0)
     {
-	string filename;
-	INT32 column = 0, line = 0;
-	string source = "<unknown>";
+	source = filename + ":" + to_string(line);
+    }
 
-	string name = RTN_FindNameByAddress((ADDRINT)rtnAddr);
-    
-	PIN_LockClient();
-	PIN_GetSourceLocation(codeAddr, &column, &line, &filename);
-	PIN_UnlockClient();
-   
-	if(filename.length() > 0)
-	{
-	    source = filename + ":" + to_string(line);
-	}
+    /* Let's retrieve the allocation information for this access.
+     * The record is copied out, so that the field name is looked up
+     * without holding the lock: VarInfo queries are safe to run
+     * concurrently.
+     */
+    MemoryRange mr(addr, size);
+    bool found = false;
+    MemoryRange range(0, 0);
+    AllocRecord record("", 0, "", "", NULL, 0, 0, 0);
 
-	/* Let's retrieve the allocation information for this access */
-	MemoryRange mr(addr, size);
+    PIN_GetLock(&lock, PIN_ThreadId()+1);
+    {
 	map<MemoryRange, AllocRecord>::iterator it = allocmap.find(mr);
-
 	if(it != allocmap.end())
 	{
-	    /* We found the allocation record corresponding to that memory access.
-	     * If it is a part of a larger structure, let's find out the field name.
-	     * Need to retrieve the offset into the data structure. If this allocation
-	     * contains multiple items (e.g., calloc-type), need to take the modulo
-	     * of the item size.
-	     */
+	    found = true;
+	    range = it->first;
+	    record = it->second;
+	}
+    }
+    PIN_ReleaseLock(&lock);
+
+    /* We found the allocation record corresponding to that memory access.
+     * If it is a part of a larger structure, let's find out the field name.
+     * Need to retrieve the offset into the data structure. If this allocation
+     * contains multiple items (e.g., calloc-type), need to take the modulo
+     * of the item size.
+     */
+    string field = "";
+    size_t offset = 0;
+    if(found)
+    {
+	offset = (addr - range.base) % record.item_size;
 
-	    if(!it->first.contains(addr))
+	if(offset >= 0 && record.vi)
+	    field = record.vi->fieldname(record.sourceFile,
+					 record.sourceLine,
+					 record.varName, offset);
+    }
+
+    PIN_GetLock(&lock, PIN_ThreadId()+1);
+    {
+	if(found)
+	{
+	    if(!range.contains(addr))
 	    {
 		cout << "WARNING!!! " << hex << addr <<"+" << size 
 		     << " is not contained in (" << 
-		    it->first.base << ", " << (it->first.base + it->first.size) << ")"
+		    range.base << ", " << (range.base + range.size) << ")"
 		     << dec << endl;
 
 		cerr << "WARNING!!! " << hex << addr <<"+" << size 
 		     << " is not contained in (" << 
-		    it->first.base << ", " << (it->first.base + it->first.size) << ")"
+		    range.base << ", " << (range.base + range.size) << ")"
 		     << dec << endl;
 
 	    }
 
-	    string field = "";
-	    size_t offset = (addr - it->first.base) % it->second.item_size;
-	    
-	    if(offset >= 0 && it->second.vi)
-		field = it->second.vi->fieldname(it->second.sourceFile, 
-						 it->second.sourceLine, 
-						 it->second.varName, offset);
-
 	    if(field.length() == 0)
 		cout << "Could not determine field for the following access type. "
-		     << "Allocation base was " << hex << it->second.base 
-		     << " Size " << dec << it->second.item_size << ", number " 
-		     << it->second.item_number << ". Offset provided was " << offset << endl;
+		     << "Allocation base was " << hex << record.base 
+		     << " Size " << dec << record.item_size << ", number " 
+		     << record.item_number << ". Offset provided was " << offset << endl;
 	    
 	    cout << (char*)accessType << " " << PIN_ThreadId() << " 0x" << hex << setw(16) 
 		 << setfill('0') << addr << dec << " " << size << " " 
-		 << name << " " << source << " " << it->second.sourceFile
-		 << ":" << it->second.sourceLine << " " << it->second.varName;
+		 << name << " " << source << " " << record.sourceFile
+		 << ":" << record.sourceLine << " " << record.varName;
 
 	    if(field.length() > 0)
 		cout << "->" << field;
  
-	    cout << " " << it->second.varType << endl;
+	    cout << " " << record.varType << endl;
 	}
 	else
 	{
@@ -1329,6 +1361,8 @@ VOID Image(IMG img, VOID *v)
 		varInfoAllocated = true;
 
 		vi = new VarInfo();
+		vi->setCacheDir(KnobVarInfoCache.Value());
+		vi->setLazy(KnobVarInfoLazy.Value());
 
 		if (!vi->init(IMG_Name(img)))
 		{
@@ -33,9 +33,17 @@ END_LEGAL */
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <unordered_map>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <new>
 #include <sys/time.h>
+#include <cpuid.h>
 #include "pin.H"
+#include "histogram.h"
+#include "rtnselect.h"
 
 /* ===================================================================== */
 /* Global Variables */
@@ -44,6 +52,7 @@ using namespace std;
 
 ofstream traceFile;
 ifstream inputFile; 
+PIN_LOCK lock;
 
 /* ===================================================================== */
 /* Commandline Switches */
@@ -55,19 +64,27 @@ KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
 KNOB<string> KnobInputFile(KNOB_MODE_WRITEONCE, "pintool",
     "i", "procnames.in", "specify filename with procedures to instrument");
 
+KNOB<BOOL> KnobTsc(KNOB_MODE_WRITEONCE, "pintool",
+    "tsc", "0", "set to 1 to time the procedures with the CPU time-stamp "
+    "counter (rdtscp) instead of clock_gettime");
+
+KNOB<string> KnobFoldedFile(KNOB_MODE_WRITEONCE, "pintool",
+    "folded", "", "specify file name for the call paths of the procedures "
+    "with their self time in ns, in the folded stacks format of flame graph "
+    "tools (not written by default)");
+
+KNOB<UINT32> KnobInterval(KNOB_MODE_WRITEONCE, "pintool",
+    "interval", "0", "every that many milliseconds, write what each procedure "
+    "did since the previous interval to the output file (0: only at exit)");
+
 /* ===================================================================== */
 
-/* Holds names of functions the user wants us to track.
- * Not all of them will be valid. Validity will be checked on
- * image load, which is when valid functions will get an associated
- * function record and will get put into a list. 
+/* Patterns on the names of the functions the user wants us to track
+ * (see rtnselect.h). They are matched against the routines of every
+ * image on load, which is when the matching functions get an associated
+ * function record and get put into a list. 
  */
-typedef struct RtnName
-{
-    string _name;
-    struct RtnName * _next;
-} RTN_NAME;
-RTN_NAME * RtnNameList = 0;
+RoutineSelector selector;
 
 // Holds routine objects and instrumentation data
 typedef struct RtnInfo
@@ -76,15 +93,85 @@ typedef struct RtnInfo
     string _image;
     ADDRINT _address;
     RTN _rtn;
+    UINT32 _id;			// index of the routine in the per-thread slots
     UINT64 _invCount;
     UINT64 _rtnCountExit;
-    UINT64 _timeOnEntry;
     UINT64 _cumTime;
+    UINT64 _inclusiveTime;	// of the outermost calls only
+    UINT64 _selfTime;		// less the time of the instrumented callees
+    LatencyHistogram _latency;	// of every invocation, in timer ticks
     struct RtnInfo * _next;
 } RTN_INFO;
 
 // Linked list of instruction counts for each routine
 RTN_INFO * RtnList = 0;
+UINT32 numRtns = 0;
+
+#define CACHE_LINE_SIZE 64
+
+/* Counters of one routine in one thread. Only the owning thread
+ * updates them, so they need no synchronization. Every slot is
+ * allocated on its own cache lines, so threads never share a line.
+ * The slots of all threads are merged into the RTN_INFO at Fini.
+ */
+typedef struct RtnSlot
+{
+    UINT64 _invCount;
+    UINT64 _cumTime;
+    UINT64 _inclusiveTime;
+    UINT64 _selfTime;
+    UINT32 _active;		// calls of the routine on the thread's stack
+    LatencyHistogram _latency;
+} __attribute__((aligned(CACHE_LINE_SIZE))) RTN_SLOT;
+
+/* A routine being executed by a thread */
+typedef struct Frame
+{
+    RTN_INFO *_ri;
+    UINT64 _timeOnEntry;
+    UINT64 _childTime;		// spent in the instrumented callees
+    UINT32 _node;		// call path (see CallNode)
+} FRAME;
+
+/* The instrumented routines a thread went through form a tree of call
+ * paths: every node is a routine called from the path of its parent.
+ * The root, node 0, is the thread itself. */
+typedef struct CallNode
+{
+    RTN_INFO *_ri;
+    UINT32 _parent;
+    UINT64 _calls;
+    UINT64 _inclusiveTime;
+    UINT64 _selfTime;
+} CALL_NODE;
+
+/* The slots of a thread, indexed by RTN_INFO::_id. When the thread
+ * meets a routine beyond the end, it replaces the table with a larger
+ * copy and publishes it atomically. The snapshot thread may still be
+ * reading the old table, so it is never freed. */
+typedef struct SlotTable
+{
+    UINT32 _size;
+    RTN_SLOT **_slots;
+} SLOT_TABLE;
+
+typedef struct ThreadData
+{
+    ThreadData() : _slotTable(new SLOT_TABLE()), _nodes(1) {}
+
+    SLOT_TABLE *_slotTable;
+    /* The shadow stack: the instrumented routines the thread is in,
+     * innermost last. A recursive call pushes a new entry instead of
+     * overwriting the entry time of the outer call. */
+    vector<FRAME> _stack;
+    vector<CALL_NODE> _nodes;
+    unordered_map<UINT64, UINT32> _children;	// (parent node, routine id) -> node
+} THREAD_DATA;
+
+/* Data of all the threads, including those that exited, so that
+ * they are merged at Fini. Protected by the lock. */
+vector<THREAD_DATA*> threadDataList;
+TLS_KEY tlsKey;
 
 const char * StripPath(const char * path)
 {
@@ -97,27 +184,251 @@ const char * StripPath(const char * path)
 
 #define BILLION 1000000000
 
+/* ===================================================================== */
+/* Timer                                                                 */
+/* ===================================================================== */
+
+/* All times are kept in timer ticks: nanoseconds of the monotonic clock,
+ * or time-stamp counter cycles with -tsc. They are converted to
+ * nanoseconds only when reported.
+ */
+BOOL useTsc = FALSE;
+double nsPerTick = 1.0;
+/* Ticks the instrumentation itself adds to every measured call,
+ * subtracted from every latency (see calibrateTimer) */
+UINT64 timerOverhead = 0;
+
+inline UINT64 rdtscp()
+{
+    UINT32 lo, hi, aux;
+
+    /* rdtscp waits for the preceding instructions to complete */
+    __asm__ __volatile__("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+    return ((UINT64)hi << 32) | lo;
+}
+
+inline UINT64 readTimer()
+{
+    timespec ts;
+
+    if(useTsc)
+	return rdtscp();
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+inline UINT64 ticksToNs(UINT64 ticks)
+{
+    return useTsc ? (UINT64)(ticks * nsPerTick + 0.5) : ticks;
+}
+
 /* ===================================================================== */
 /* Analysis routines                                                     */
 /* ===================================================================== */
  
-VOID callBefore(RTN_INFO *ri)
+RTN_SLOT *allocateSlot()
 {
-    timespec ts;
+    void *mem;
+
+    if(posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(RTN_SLOT)))
+    {
+	cerr << "Could not allocate memory for routine counters. Aborting..." << endl;
+	exit(-1);
+    }
+    RTN_SLOT *slot = new (mem) RTN_SLOT;
+    slot->_invCount = 0;
+    slot->_cumTime = 0;
+    slot->_inclusiveTime = 0;
+    slot->_selfTime = 0;
+    slot->_active = 0;
+    return slot;
+}
+
+SLOT_TABLE *growSlotTable(THREAD_DATA *td, UINT32 size)
+{
+    SLOT_TABLE *table = new SLOT_TABLE;
+    SLOT_TABLE *old = td->_slotTable;
+
+    table->_size = max(size, 2 * old->_size);
+    table->_slots = new RTN_SLOT*[table->_size]();
+    for (UINT32 i = 0; i < old->_size; i++)
+	table->_slots[i] = old->_slots[i];
+    __atomic_store_n(&td->_slotTable, table, __ATOMIC_RELEASE);
+    return table;
+}
+
+/* The thread's counters of the routine. Routines may be found after
+ * the thread started, so the slots are added when first needed. */
+inline RTN_SLOT *getSlot(THREAD_DATA *td, RTN_INFO *ri)
+{
+    SLOT_TABLE *table = td->_slotTable;
 
-    ri->_invCount++;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    ri->_timeOnEntry = ts.tv_sec * BILLION + ts.tv_nsec;
+    if(table->_size <= ri->_id)
+	table = growSlotTable(td, ri->_id + 1);
+    if(!table->_slots[ri->_id])
+	__atomic_store_n(&table->_slots[ri->_id], allocateSlot(), __ATOMIC_RELEASE);
+    return table->_slots[ri->_id];
 }
 
-VOID callAfter(RTN_INFO *ri)
+/* The thread's counters of the routine for other threads, NULL if
+ * the thread never ran it */
+inline RTN_SLOT *findSlot(THREAD_DATA *td, RTN_INFO *ri)
 {
-    timespec timeAfter;
+    SLOT_TABLE *table = __atomic_load_n(&td->_slotTable, __ATOMIC_ACQUIRE);
+
+    if(table->_size <= ri->_id)
+	return NULL;
+    return __atomic_load_n(&table->_slots[ri->_id], __ATOMIC_ACQUIRE);
+}
+
+/* The node of the call path 'parent' continued by the routine */
+inline UINT32 getNode(THREAD_DATA *td, UINT32 parent, RTN_INFO *ri)
+{
+    UINT64 key = ((UINT64)parent << 32) | ri->_id;
+    unordered_map<UINT64, UINT32>::iterator it = td->_children.find(key);
+
+    if(it != td->_children.end())
+	return it->second;
+
+    CALL_NODE node = {ri, parent, 0, 0, 0};
+    td->_nodes.push_back(node);
+    td->_children.insert(make_pair(key, (UINT32)(td->_nodes.size() - 1)));
+    return td->_nodes.size() - 1;
+}
+
+inline VOID enterRoutine(THREAD_DATA *td, RTN_INFO *ri)
+{
+    FRAME frame;
+    RTN_SLOT *slot = getSlot(td, ri);
+
+    slot->_invCount++;
+    slot->_active++;
+    frame._ri = ri;
+    frame._childTime = 0;
+    frame._node = getNode(td, td->_stack.empty() ? 0 : td->_stack.back()._node, ri);
+    td->_stack.push_back(frame);
+    /* Read last, so that the bookkeeping is not timed */
+    td->_stack.back()._timeOnEntry = readTimer();
+}
+
+/* Returns the latency of the call before the overhead is subtracted */
+inline UINT64 leaveRoutine(THREAD_DATA *td, RTN_INFO *ri)
+{
+    UINT64 timeAfter, elapsed;
     
-    clock_gettime(CLOCK_REALTIME, &timeAfter);
-    ri->_cumTime += (timeAfter.tv_sec * BILLION + timeAfter.tv_nsec) -
-	ri->_timeOnEntry;
+    timeAfter = readTimer();
+
+    /* Routines left by a longjmp or an exception never return, so
+     * their frames are dropped down to the one of this routine. If
+     * there is none, we missed the entry and there is nothing to time.
+     */
+    while(!td->_stack.empty() && td->_stack.back()._ri != ri)
+    {
+	getSlot(td, td->_stack.back()._ri)->_active--;
+	td->_stack.pop_back();
+    }
+    if(td->_stack.empty())
+	return 0;
+
+    FRAME frame = td->_stack.back();
+    td->_stack.pop_back();
+    elapsed = timeAfter - frame._timeOnEntry;
+
+    UINT64 latency = elapsed > timerOverhead ? elapsed - timerOverhead : 0;
+    UINT64 self = latency > frame._childTime ? latency - frame._childTime : 0;
+
+    /* The caller's time includes this call, instrumentation included */
+    if(!td->_stack.empty())
+	td->_stack.back()._childTime += elapsed;
+
+    RTN_SLOT *slot = getSlot(td, ri);
+    slot->_cumTime += latency;
+    slot->_selfTime += self;
+    /* Recursive calls are inside the outermost one, count it only */
+    if(--slot->_active == 0)
+	slot->_inclusiveTime += latency;
+    slot->_latency.record(latency);
+
+    CALL_NODE &node = td->_nodes[frame._node];
+    node._calls++;
+    node._inclusiveTime += latency;
+    node._selfTime += self;
+    return elapsed;
+}
+
+VOID callBefore(RTN_INFO *ri, THREADID tid)
+{
+    enterRoutine(static_cast<THREAD_DATA*>(PIN_GetThreadData(tlsKey, tid)), ri);
+}
+
+VOID callAfter(RTN_INFO *ri, THREADID tid)
+{
+    leaveRoutine(static_cast<THREAD_DATA*>(PIN_GetThreadData(tlsKey, tid)), ri);
+}
 
+/* With -tsc, finds how many nanoseconds a time-stamp counter tick
+ * takes. Then times an empty call the way the instrumentation does:
+ * the smallest latency found is the cost of taking the timestamps and
+ * of the bookkeeping between them, which every measured call includes.
+ */
+VOID calibrateTimer()
+{
+    useTsc = KnobTsc.Value();
+    if(useTsc)
+    {
+	UINT32 eax, ebx, ecx, edx;
+
+	if(!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 27)))
+	{
+	    cerr << "The CPU has no rdtscp instruction, using clock_gettime." << endl;
+	    useTsc = FALSE;
+	}
+	else if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+	    cerr << "Warning: the time-stamp counter rate is not invariant, " 
+		 << "timings may be off when the CPU frequency changes." << endl;
+    }
+
+    if(useTsc)
+    {
+	timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	UINT64 startTicks = rdtscp();
+	usleep(100 * 1000);
+	UINT64 endTicks = rdtscp();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	nsPerTick = (double)((end.tv_sec - start.tv_sec) * BILLION + 
+			     end.tv_nsec - start.tv_nsec) / (endTicks - startTicks);
+	cout << "Time-stamp counter runs at " << 1.0 / nsPerTick << " GHz" << endl;
+    }
+
+    THREAD_DATA td;
+    RTN_INFO ri;
+    UINT64 best = ~0ULL;
+
+    ri._id = 0;
+    for (int i = 0; i < 10000; i++)
+    {
+	enterRoutine(&td, &ri);
+	UINT64 elapsed = leaveRoutine(&td, &ri);
+	if(elapsed < best)
+	    best = elapsed;
+    }
+    free(findSlot(&td, &ri));
+    timerOverhead = best;
+    cout << "Timer overhead: " << ticksToNs(timerOverhead) << " ns per call" << endl;
+}
+
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    THREAD_DATA *td = new THREAD_DATA;
+
+    PIN_SetThreadData(tlsKey, td, tid);
+
+    PIN_GetLock(&lock, tid+1);
+    threadDataList.push_back(td);
+    PIN_ReleaseLock(&lock);
 }
 
 /* ===================================================================== */
@@ -126,92 +437,335 @@ VOID callAfter(RTN_INFO *ri)
    
 VOID Image(IMG img, VOID *v)
 {
-    /* Go over all the routines we are instrumenting and insert the
-     * instrumentation.
+    /* Go over all the routines of the image once and instrument
+     * those matching a pattern.
      */
+    selector.forEachRoutine(img, [](RTN rtn, int pattern)
+    {
+	if (pattern == RoutineSelector::NO_MATCH)
+	    return;
 
-    for (RTN_NAME * rn = RtnNameList; rn; rn = rn->_next)
-    { 
-	RTN rtn = RTN_FindByName(img, rn->_name.c_str());
-
-	if (RTN_Valid(rtn))
-	{
-	    cout << "Procedure " << rn->_name << " located." << endl;
+	cout << "Procedure " << RTN_Name(rtn) << " located." << endl;
 
-	    // Allocate a counter for this routine
-	    RTN_INFO * ri = new RTN_INFO;
+	// Allocate a counter for this routine
+	RTN_INFO * ri = new RTN_INFO;
 
-	    // The RTN goes away when the image is unloaded, so save it now
-	    // because we need it in the fini
-	    ri->_name = RTN_Name(rtn);
+	// The RTN goes away when the image is unloaded, so save it now
+	// because we need it in the fini
+	ri->_name = RTN_Name(rtn);
 
-	    ri->_image = StripPath(IMG_Name(SEC_Img(RTN_Sec(rtn))).c_str());
-	    ri->_address = RTN_Address(rtn);
-	    ri->_invCount = 0;
+	ri->_image = StripPath(IMG_Name(SEC_Img(RTN_Sec(rtn))).c_str());
+	ri->_address = RTN_Address(rtn);
+	ri->_id = numRtns++;
+	ri->_invCount = 0;
+	ri->_cumTime = 0;
+	ri->_inclusiveTime = 0;
+	ri->_selfTime = 0;
 
-	    // Add to list of routines
-	    ri->_next = RtnList;
-	    RtnList = ri;
+	// Add to list of routines
+	ri->_next = RtnList;
+	RtnList = ri;
 
-	    RTN_Open(rtn);
+	RTN_Open(rtn);
 
-	    // Instrument 
-	    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)callBefore,
-			   IARG_PTR, ri, IARG_END);
-	    RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)callAfter,
-			   IARG_PTR, ri, IARG_END);
+	// Instrument 
+	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)callBefore,
+		       IARG_PTR, ri, IARG_THREAD_ID, IARG_END);
+	RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)callAfter,
+		       IARG_PTR, ri, IARG_THREAD_ID, IARG_END);
 
-	    RTN_Close(rtn);
-	}
-    }
+	RTN_Close(rtn);
+    });
 
 }
 /* ===================================================================== */
 /* Build the list of procedures we want to instrument                    */
 /* ===================================================================== */
 
+/* Every word of the file is a pattern, up to a word starting with a
+ * '#', which comments out the rest of the line.
+ */
 VOID buildProcedureList(ifstream& f)
 {
 
     cout << "Routines specified for instrumentation:" << endl;
-    while(!f.eof())
+    string line;
+    while(getline(f, line))
     {
-	RTN_NAME *rn = new RTN_NAME;
-	f >> rn->_name;
-	cout << rn->_name << endl;
-	rn->_next = RtnNameList;
-	RtnNameList = rn;
+	istringstream str(line);
+	string word;
+	while(str >> word)
+	{
+	    if(word[0] == '#')
+		break;
+
+	    string error;
+	    if(selector.add(word, error) == RoutineSelector::NO_MATCH)
+	    {
+		cerr << "Invalid routine pattern " << word << ": " << error << endl;
+		exit(-1);
+	    }
+	    cout << word << endl;
+	}
     }
 
 }
 
 
 /* ===================================================================== */
+/* Interval snapshots                                                    */
+/* ===================================================================== */
+
+/* Counters of a routine summed over all threads */
+typedef struct RtnTotals
+{
+    UINT64 _invCount;
+    UINT64 _cumTime;
+    LatencyHistogram _latency;
+} RTN_TOTALS;
+
+volatile BOOL snapshotsDone = FALSE;
+PIN_THREAD_UID snapshotThreadUid;
+
+UINT64 monotonicNs()
+{
+    timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+/* Writes a line for every routine called since the previous snapshot,
+ * whose totals are in 'previous' (indexed by RTN_INFO::_id).
+ */
+VOID writeSnapshot(vector<RTN_TOTALS> &previous, UINT32 number, UINT64 startTime)
+{
+    vector<RTN_INFO*> rtns;
+    vector<THREAD_DATA*> threads;
+    RTN_TOTALS current;
+
+    /* Routines are added by the image callbacks, which hold the client lock */
+    PIN_LockClient();
+    for (RTN_INFO * ri = RtnList; ri; ri = ri->_next)
+    {
+	rtns.push_back(ri);
+	if(previous.size() <= ri->_id)
+	    previous.resize(ri->_id + 1);
+    }
+    PIN_UnlockClient();
+
+    PIN_GetLock(&lock, PIN_ThreadId() + 1);
+    threads = threadDataList;
+    PIN_ReleaseLock(&lock);
+
+    UINT64 time = (monotonicNs() - startTime) / 1000000;
+
+    for (RTN_INFO *ri: rtns)
+    {
+	current._invCount = 0;
+	current._cumTime = 0;
+	current._latency.reset();
+
+	/* The counters are read while their threads update them, without
+	 * synchronization. Each of them only grows, so a snapshot may
+	 * miss the calls in progress but the next one catches them.
+	 */
+	for (THREAD_DATA *td: threads)
+	{
+	    RTN_SLOT *slot = findSlot(td, ri);
+	    if(!slot)
+		continue;
+	    current._invCount += slot->_invCount;
+	    current._cumTime += slot->_cumTime;
+	    current._latency.add(slot->_latency);
+	}
+
+	RTN_TOTALS delta = current;
+	RTN_TOTALS &last = previous[ri->_id];
+	delta._invCount -= last._invCount;
+	delta._cumTime -= last._cumTime;
+	delta._latency.subtract(last._latency);
+	last = current;
+
+	if(delta._invCount == 0)
+	    continue;
+
+	traceFile << setw(8) << number << " "
+		  << setw(10) << time << " "
+		  << setw(23) << ri->_name << " "
+		  << setw(12) << delta._invCount << " "
+		  << setw(12) << (delta._latency.count() ? 
+				  ticksToNs(delta._cumTime / delta._latency.count()) : 0) << " "
+		  << setw(12) << ticksToNs(delta._latency.percentile(50)) << " "
+		  << setw(12) << ticksToNs(delta._latency.percentile(90)) << " "
+		  << setw(12) << ticksToNs(delta._latency.percentile(99)) << " "
+		  << setw(12) << ticksToNs(delta._latency.percentile(99.9)) << " "
+		  << setw(12) << ticksToNs(delta._latency.max()) << endl;
+    }
+
+    /* The process may be killed at any time */
+    traceFile.flush();
+}
+
+/* Internal thread writing a snapshot every -interval ms until the
+ * program exits */
+VOID snapshotThread(VOID *arg)
+{
+    vector<RTN_TOTALS> previous;
+    UINT64 startTime = monotonicNs();
+    UINT64 nextTime = startTime;
+    UINT32 number = 0;
+
+    traceFile << setw(8) << "Interval" << " "
+	      << setw(10) << "Time ms" << " "
+	      << setw(23) << "Procedure" << " "
+	      << setw(12) << "Calls" << " "
+	      << setw(12) << "Avg. ns" << " "
+	      << setw(12) << "p50" << " "
+	      << setw(12) << "p90" << " "
+	      << setw(12) << "p99" << " "
+	      << setw(12) << "p99.9" << " "
+	      << setw(12) << "Max" << endl;
+
+    while(!snapshotsDone && !PIN_IsProcessExiting())
+    {
+	/* Sleep in short steps so that the exit is not held up */
+	nextTime += (UINT64)KnobInterval.Value() * 1000000;
+	for (UINT64 now = monotonicNs(); now < nextTime && !snapshotsDone; 
+	     now = monotonicNs())
+	    PIN_Sleep(min((UINT64)100, (nextTime - now) / 1000000 + 1));
+
+	if(!snapshotsDone)
+	    writeSnapshot(previous, ++number, startTime);
+    }
+    traceFile << endl;
+}
+
+/* Internal threads must be done before Fini runs */
+VOID PrepareForFini(VOID *v)
+{
+    snapshotsDone = TRUE;
+    PIN_WaitForThreadTermination(snapshotThreadUid, PIN_INFINITE_TIMEOUT, NULL);
+}
+
+/* ===================================================================== */
+
+/* One line per call path: the routines from the outermost one separated
+ * by semicolons, then the self time of the last one in ns. The paths
+ * of all threads are added up.
+ */
+VOID writeFoldedStacks(const string &fileName)
+{
+    ofstream foldedFile(fileName.c_str());
+    map<string, UINT64> stacks;
+
+    for (THREAD_DATA *td: threadDataList)
+    {
+	vector<string> paths(td->_nodes.size());
+	/* Parents are created before their children */
+	for (UINT32 i = 1; i < td->_nodes.size(); i++)
+	{
+	    CALL_NODE &node = td->_nodes[i];
+	    if(node._parent)
+		paths[i] = paths[node._parent] + ";";
+	    paths[i] += node._ri->_name;
+	    stacks[paths[i]] += node._selfTime;
+	}
+    }
+
+    for (auto &stack: stacks)
+    {
+	if(ticksToNs(stack.second) > 0)
+	    foldedFile << stack.first << " " << ticksToNs(stack.second) << endl;
+    }
+    foldedFile.close();
+}
 
 VOID Fini(INT32 code, VOID *v)
 {
+    /* Merge the counters of all threads */
+    for (THREAD_DATA *td: threadDataList)
+    {
+	for (RTN_INFO * ri = RtnList; ri; ri = ri->_next)
+	{
+	    RTN_SLOT *slot = findSlot(td, ri);
+	    if(!slot)
+		continue;
+	    ri->_invCount += slot->_invCount;
+	    ri->_cumTime += slot->_cumTime;
+	    ri->_inclusiveTime += slot->_inclusiveTime;
+	    ri->_selfTime += slot->_selfTime;
+	    ri->_latency.add(slot->_latency);
+	}
+    }
 
     traceFile << setw(23) << "Procedure" << " "
 	      << setw(15) << "Image" << " "
 	      << setw(18) << "Address" << " "
 	      << setw(12) << "Calls" << " "
-	      << setw(12) << "Avg. Cycles" << endl;
+	      << setw(12) << "Avg. ns" << " "
+	      << setw(12) << "p50" << " "
+	      << setw(12) << "p90" << " "
+	      << setw(12) << "p99" << " "
+	      << setw(12) << "p99.9" << " "
+	      << setw(12) << "Max" << " "
+	      << setw(15) << "Total ns" << " "
+	      << setw(15) << "Self ns" << endl;
 
     for (RTN_INFO * ri = RtnList; ri; ri = ri->_next)
     {
+	traceFile << setw(23) << ri->_name << " "
+		  << setw(15) << ri->_image << " "
+		  << setw(18) << hex << ri->_address << dec <<" "
+		  << setw(12) << ri->_invCount << " ";
 	if(ri->_invCount>0)
-	    traceFile << setw(23) << ri->_name << " "
-		      << setw(15) << ri->_image << " "
-		      << setw(18) << hex << ri->_address << dec <<" "
-		      << setw(12) << ri->_invCount << " "
-		      << setw(12) << ri->_cumTime/ri->_invCount << endl;	
+	    traceFile << setw(12) << ticksToNs(ri->_cumTime/ri->_invCount) << " ";
 	else
-	    traceFile << setw(23) << ri->_name << " "
-		      << setw(15) << ri->_image << " "
-		      << setw(18) << hex << ri->_address << dec <<" "
-		      << setw(12) << ri->_invCount << " "
-		      << setw(12) << ri->_cumTime << endl;	
+	    traceFile << setw(12) << ticksToNs(ri->_cumTime) << " ";
+
+	/* Averages hide the slow paths, so show the tail of the
+	 * latency distribution too. */
+	traceFile << setw(12) << ticksToNs(ri->_latency.percentile(50)) << " "
+		  << setw(12) << ticksToNs(ri->_latency.percentile(90)) << " "
+		  << setw(12) << ticksToNs(ri->_latency.percentile(99)) << " "
+		  << setw(12) << ticksToNs(ri->_latency.percentile(99.9)) << " "
+		  << setw(12) << ticksToNs(ri->_latency.max()) << " "
+		  << setw(15) << ticksToNs(ri->_inclusiveTime) << " "
+		  << setw(15) << ticksToNs(ri->_selfTime) << endl;
+    }
+
+    /* Time of the callees by caller, from the call paths of all threads */
+    map<pair<RTN_INFO*, RTN_INFO*>, pair<UINT64, UINT64> > edges;
+    for (THREAD_DATA *td: threadDataList)
+    {
+	for (UINT32 i = 1; i < td->_nodes.size(); i++)
+	{
+	    CALL_NODE &node = td->_nodes[i];
+	    RTN_INFO *caller = td->_nodes[node._parent]._ri;
+	    if(!caller)
+		continue;
+	    pair<UINT64, UINT64> &edge = edges[make_pair(caller, node._ri)];
+	    edge.first += node._calls;
+	    edge.second += node._inclusiveTime;
+	}
     }
+
+    if(!edges.empty())
+    {
+	traceFile << endl
+		  << setw(23) << "Caller" << " "
+		  << setw(23) << "Callee" << " "
+		  << setw(12) << "Calls" << " "
+		  << setw(15) << "Total ns" << endl;
+	for (auto &edge: edges)
+	    traceFile << setw(23) << edge.first.first->_name << " "
+		      << setw(23) << edge.first.second->_name << " "
+		      << setw(12) << edge.second.first << " "
+		      << setw(15) << ticksToNs(edge.second.second) << endl;
+    }
+
+    if(KnobFoldedFile.Value().length() > 0)
+	writeFoldedStacks(KnobFoldedFile.Value());
     
 
     traceFile.close();
@@ -242,14 +796,30 @@ int main(int argc, char *argv[])
     }
     
 
+    PIN_InitLock(&lock);
+    tlsKey = PIN_CreateThreadDataKey(0);
+    calibrateTimer();
+
     traceFile.open(KnobOutputFile.Value().c_str());
     inputFile.open(KnobInputFile.Value().c_str());
     buildProcedureList(inputFile);
 
     /* Register Image to be called to instrument functions.*/
     IMG_AddInstrumentFunction(Image, 0);
+    PIN_AddThreadStartFunction(ThreadStart, 0);
     PIN_AddFiniFunction(Fini, 0);
 
+    if(KnobInterval.Value() > 0)
+    {
+	if(PIN_SpawnInternalThread(snapshotThread, 0, 0, &snapshotThreadUid) ==
+	   INVALID_THREADID)
+	{
+	    cerr << "Snapshot thread could not be created..." << endl;
+	    exit(1);
+	}
+	PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+    }
+
     // Never returns
     PIN_StartProgram();
     
@@ -0,0 +1,180 @@
+/// Selects the routines a tool instruments by patterns on their names.
+/// A pattern is matched against both the symbol name and its demangled
+/// name without the parameters (ns::Class::method), and is one of:
+///
+///   name           the exact name, as before
+///   wt::btree::*   a glob, where * matches any run of characters and
+///                  ? any single one
+///   /regex/        a POSIX extended regular expression, found anywhere
+///                  in the name unless anchored with ^ and $
+///
+/// and may be preceded by a glob on the image file name and a '!', as in
+/// libwiredtiger*!__wt_*, to select only in the matching images. The
+/// image glob is matched against the full path if it has a '/' in it.
+///
+/// The patterns are compiled once: exact names go into a hash table and
+/// the image globs are checked once per image, so every routine of an
+/// image costs two lookups plus a test of the wildcard patterns that
+/// apply to the image.
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <string.h>
+#include <regex.h>
+#include "pin.H"
+
+
+class RoutineSelector {
+public:
+	enum { NO_MATCH = -1 };
+
+	// Adds a pattern and returns its index, the patterns being numbered
+	// in the order they are added. Returns NO_MATCH and sets 'error' if
+	// the pattern is not valid.
+	int add(const std::string& text, std::string& error) {
+		Pattern p;
+		p.text = text;
+		p.regex = 0;
+		std::string name = text;
+		const size_t bang = '/' == text[0] ? std::string::npos : text.find('!');
+		if (std::string::npos != bang) {
+			p.image = text.substr(0, bang);
+			name = text.substr(bang + 1);
+		}
+		if (name.empty()) {
+			error = "no routine name";
+			return NO_MATCH;
+		}
+		if ('/' == name[0]) {
+			if (name.size() < 2 || '/' != name[name.size() - 1]) {
+				error = "regular expression without a closing /";
+				return NO_MATCH;
+			}
+			p.regex = new regex_t;
+			const int rc = regcomp(p.regex, name.substr(1, name.size() - 2).c_str(),
+				REG_EXTENDED | REG_NOSUB);
+			if (rc) {
+				char msg[256];
+				regerror(rc, p.regex, msg, sizeof(msg));
+				error = msg;
+				delete p.regex;
+				return NO_MATCH;
+			}
+		}
+		p.name = name;
+		const int index = (int)_patterns.size();
+		if (!p.regex && std::string::npos == name.find_first_of("*?"))
+			_exact[name].push_back(index);
+		else
+			_wildcards.push_back(index);
+		_patterns.push_back(p);
+		return index;
+	}
+
+	size_t size() const { return _patterns.size(); }
+	const std::string& pattern(const size_t i) const { return _patterns[i].text; }
+
+	// Calls visit(rtn, index) for every routine of 'img', with the index
+	// of the first pattern it matches or NO_MATCH.
+	template <class VISITOR>
+	void forEachRoutine(IMG img, VISITOR visit) const {
+		const std::string& path = IMG_Name(img);
+		const char *slash = strrchr(path.c_str(), '/');
+		const char *file = slash ? slash + 1 : path.c_str();
+
+		std::vector<char> active(_patterns.size());
+		for (size_t i = 0; i < _patterns.size(); ++i) {
+			const std::string& image = _patterns[i].image;
+			active[i] = image.empty() || glob(image.c_str(),
+				std::string::npos == image.find('/') ? file : path.c_str());
+		}
+
+		for (SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec)) {
+			for (RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn))
+				visit(rtn, match(RTN_Name(rtn), active));
+		}
+	}
+
+	// Does 'text' match the glob 'pattern' as a whole?
+	static bool glob(const char *pattern, const char *text) {
+		const char *star = 0, *resume = 0;
+		while (*text) {
+			if ('*' == *pattern) {
+				star = pattern++;
+				resume = text;
+			} else if ('?' == *pattern || *pattern == *text) {
+				++pattern;
+				++text;
+			} else if (star) {
+				// Let the last star take one more character
+				pattern = star + 1;
+				text = ++resume;
+			} else {
+				return false;
+			}
+		}
+		while ('*' == *pattern)
+			++pattern;
+		return !*pattern;
+	}
+
+private:
+	struct Pattern {
+		std::string text;	// as given
+		std::string image;	// glob on the image, empty for all images
+		std::string name;
+		regex_t *regex;		// if the name is a /regex/
+	};
+
+	int match(const std::string& symbol, const std::vector<char>& active) const {
+		// Only C++ names are mangled
+		std::string demangled;
+		if (0 == symbol.compare(0, 2, "_Z"))
+			demangled = PIN_UndecorateSymbolName(symbol, UNDECORATION_NAME_ONLY);
+		if (demangled == symbol)
+			demangled.clear();
+
+		int best = NO_MATCH;
+		matchExact(symbol, active, best);
+		if (!demangled.empty())
+			matchExact(demangled, active, best);
+
+		for (size_t w = 0; w < _wildcards.size(); ++w) {
+			const int i = _wildcards[w];
+			if (NO_MATCH != best && i > best)
+				break;
+			if (!active[i])
+				continue;
+			if (matches(_patterns[i], symbol) ||
+				(!demangled.empty() && matches(_patterns[i], demangled)))
+				return i;
+		}
+		return best;
+	}
+
+	void matchExact(const std::string& name, const std::vector<char>& active,
+		int& best) const {
+		auto found = _exact.find(name);
+		if (_exact.end() == found)
+			return;
+		for (auto i = found->second.begin(); found->second.end() != i; ++i) {
+			if (active[*i]) {
+				if (NO_MATCH == best || *i < best)
+					best = *i;
+				return;
+			}
+		}
+	}
+
+	static bool matches(const Pattern& p, const std::string& name) {
+		if (p.regex)
+			return 0 == regexec(p.regex, name.c_str(), 0, 0, 0);
+		return glob(p.name.c_str(), name.c_str());
+	}
+
+	std::vector<Pattern> _patterns;
+	// Indices of the exact names, in order, by name
+	std::unordered_map<std::string, std::vector<int> > _exact;
+	std::vector<int> _wildcards;	// in order
+};
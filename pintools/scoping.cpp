@@ -2,92 +2,270 @@
 /// as pairs of opened and closed brackets '{..}'.
 ///
 /// Sep - 2014, Nik Zaborovsky
+#include <cstdio>
+#include <cctype>
+#include <cassert>
 #include <vector>
 #include <string>
 #include <fstream>
-#include <sstream>
+#include <iterator>
+#include <thread>
+#include <atomic>
 #include <algorithm>
 #include "scoping.h"
 
 namespace {
-	struct tri_t {
-			static tri_t *const make(int level, int start, int end) { return new tri_t(level, start, end); }
-			int _level, _start, _end;
-		private:
-			tri_t(int level, int start, int end) : _level(level), _start(start), _end(end) {};
-		};
+	bool is_ident(const char c) {
+		return isalnum(static_cast<unsigned char>(c)) || '_' == c;
+	}
+
+	// Start of the identifier or number token which ends right before 'pos'
+	size_t token_start(const std::string& text, size_t pos) {
+		while (pos > 0 && (is_ident(text[pos - 1]) || '\'' == text[pos - 1] ||
+			'.' == text[pos - 1]))
+			--pos;
+		return pos;
+	}
+
+	// Is 'pos' the end of a line continued with a backslash?
+	bool continued(const std::string& text, size_t pos) {
+		if (pos > 0 && '\r' == text[pos - 1])
+			--pos;
+		return pos > 0 && '\\' == text[pos - 1];
+	}
+
+	int count_lines(const std::string& text, size_t from, size_t to) {
+		return static_cast<int>(std::count(text.begin() + from, text.begin() + to, '\n'));
+	}
+}
+
+
+// Walks the file once keeping the stack of the scopes opened so far.
+// Brackets inside comments, string and character literals (raw strings
+// included) are not counted.
+bool scoping::parse(const std::string& file_path, scope_t& result) {
+	std::ifstream fstream(file_path.c_str(), std::ios::in | std::ios::binary);
+	if (!fstream.is_open()) {
+		
+		printf("Scoping: cannot open file %s\n", file_path.c_str());
+		return true;
+	}
+	const std::string text((std::istreambuf_iterator<char>(fstream)),
+		std::istreambuf_iterator<char>());
+	fstream.close();
+
+	std::vector<unsigned> opened;
+	const interval file_scope = {1, NO_END_LINE, 0};
+	result.push_back(file_scope);
+	opened.push_back(0);
+
+	int lineno = 1;
+	const size_t size = text.size();
+	for (size_t i = 0; i < size; ++i) {
+		switch (text[i]) {
+		case '\n':
+			++lineno;
+			break;
+		case '{': {
+			const interval sc = {lineno, NO_END_LINE, opened.back()};
+			opened.push_back(result.size());
+			result.push_back(sc);
+			break;
+		}
+		case '}':
+			if (1 == opened.size()) {
+				printf("Closing bracked without opening one in line %d\n", lineno);
+				assert(false && "Closing bracket without opening bracket");
+				return false;
+			}
+			result[opened.back()].end = lineno;
+			opened.pop_back();
+			break;
+		case '/':
+			if (i + 1 >= size)
+				break;
+			if ('/' == text[i + 1]) {
+				// Up to the end of line, which a backslash continues
+				for (i += 2; i < size; ++i) {
+					if ('\n' != text[i])
+						continue;
+					if (!continued(text, i))
+						break;
+					++lineno;
+				}
+				--i;	// the end of line is counted by the loop
+			} else if ('*' == text[i + 1]) {
+				const size_t end = text.find("*/", i + 2);
+				const size_t stop = std::string::npos == end ? size : end + 2;
+				lineno += count_lines(text, i, stop);
+				i = stop - 1;
+			}
+			break;
+		case '\'':
+			// A digit separator (1'000'000) rather than a character literal
+			if (i > 0 && is_ident(text[i - 1]) &&
+				isdigit(static_cast<unsigned char>(text[token_start(text, i)])))
+				break;
+			// fall through
+		case '"': {
+			const char quote = text[i];
+			if ('"' == quote && i > 0 && 'R' == text[i - 1]) {
+				const size_t prefix = token_start(text, i);
+				const std::string p = text.substr(prefix, i - prefix);
+				if ("R" == p || "LR" == p || "uR" == p || "UR" == p || "u8R" == p) {
+					const size_t open = text.find('(', i + 1);
+					if (std::string::npos != open) {
+						const std::string delim = ")" + text.substr(i + 1, open - i - 1) + "\"";
+						const size_t end = text.find(delim, open + 1);
+						const size_t stop = std::string::npos == end ? size : end + delim.size();
+						lineno += count_lines(text, i, stop);
+						i = stop - 1;
+						break;
+					}
+				}
+			}
+			// Up to the closing quote or to the end of line if unterminated
+			for (++i; i < size && quote != text[i]; ++i) {
+				if ('\\' == text[i] && i + 1 < size) {
+					if ('\n' == text[++i])
+						++lineno;
+				} else if ('\n' == text[i]) {
+					--i;
+					break;
+				}
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+	// Number of lines as getline counts them
+	const int lines = text.empty() ? 0 : lineno - ('\n' == text[size - 1] ? 1 : 0);
+
+	if (1 != opened.size()) {
+		printf("Not balanced brackets in file %s\n", file_path.c_str());
+		printf("Number of not balanced brackets is: %d\n",
+			static_cast<int>(opened.size()) - 1);
+		printf("There can be incorrect scoping in file %s\n", file_path.c_str());
+	}
+	result[0].end = lines;
+	return true;
+}
+
+
+const scoping::scope_t *scoping::find(const std::string& file) const {
+	auto sc = _scopes.find(file);
+	return _scopes.end() == sc ? 0 : &sc->second;
 }
 
 
-bool scoping::init(const std::vector<std::string>& srcfiles, const std::string& paths_prefix) {
+int scoping::last_opened(const scope_t& sc, int line) {
+	struct start_less {
+		bool operator() (int line, const interval& item) const { return line < item.start; }
+	};
+	auto i = std::upper_bound(sc.begin(), sc.end(), line, start_less());
+	return static_cast<int>(i - sc.begin()) - 1;
+}
+
+
+int scoping::endline(const std::string& file, int startline) const {
+	const scope_t *sc = find(file);
+	if (!sc)
+		return NO_END_LINE;
+	const int i = last_opened(*sc, startline);
+	if (i < 0 || (*sc)[i].start != startline || 0 == (*sc)[i].end)
+		return NO_END_LINE;
+	return (*sc)[i].end;
+}
+
+
+// Scopes nest, so the scopes opened before the declaration line which
+// include it are all enclosing the scope opened last before it.
+std::pair<int, int> scoping::scope(const std::string& file, int declline) const {
+	const scope_t *sc = find(file);
+	if (!sc)
+		return std::make_pair(0, 0);
+	int i = last_opened(*sc, declline);
+	while (i >= 0) {
+		const interval& item = (*sc)[i];
+		if (item.end >= declline)
+			return std::make_pair(item.start, item.end);
+		if (0 == i)
+			break;
+		i = item.parent;
+	}
+	return std::make_pair(0, 0);
+}
+
+
+int scoping::nextScope(const std::string& file, int line) const {
+	const scope_t *sc = find(file);
+	if (!sc)
+		return 0;
+	struct start_less {
+		bool operator() (const interval& item, int line) const { return item.start < line; }
+	};
+	auto i = std::lower_bound(sc->begin(), sc->end(), line, start_less());
+	return sc->end() == i ? 0 : i->start;
+}
+
+
+bool scoping::init(const std::vector<std::string>& srcfiles, const std::string& paths_prefix,
+	const unsigned threads) {
 	_scopes.clear();
+	return add(srcfiles, paths_prefix, threads);
+}
+
+
+bool scoping::add(const std::vector<std::string>& srcfiles, const std::string& paths_prefix,
+	const unsigned threads) {
 	_path_prefix = paths_prefix;
 	static const std::string built_in = "<built-in>";
-	std::vector<tri_t*> scopes;
+
+	std::vector<std::string> paths;
 	for (const std::string& f : srcfiles) {
-		std::ifstream fstream;
-		scopes.clear();
-	
+		if (f.empty())
+			continue;
 		std::string file_path;
 		if ('/' != f[0])
 			file_path = _path_prefix;
 		file_path += f;
-		if (0 == file_path.compare(file_path.size() - built_in.size(),
+		if (file_path.size() >= built_in.size() &&
+			0 == file_path.compare(file_path.size() - built_in.size(),
 			built_in.size(), built_in.c_str()))
 			continue;
-		fstream.open(file_path.c_str());
-		if (!fstream.is_open()) {
-			
-			printf("Scoping: cannot open file %s\n", file_path.c_str());
+		if (_scopes.end() != _scopes.find(file_path))
 			continue;
-		}
-		int nesting_level = 0;
-		int lineno = 0;
-		struct look_for_empty_end_of_nesting_level {
-			look_for_empty_end_of_nesting_level(int level) : _level(level) {};
-			bool operator() (tri_t *& item) { return item->_level == _level && NO_END_LINE == item->_end; }
-		private:
-			const int _level;
-		};
-
-		scopes.push_back(tri_t::make(nesting_level, 1, NO_END_LINE));
-		++nesting_level;
-		std::string line;
-
-		while(std::getline(fstream, line)) {
-			++lineno;
-			for (unsigned i = 0; i < line.size(); ++i) {
-				if ('{' == line[i]) {
-					scopes.push_back(tri_t::make(nesting_level, lineno, NO_END_LINE));
-					++nesting_level;
-				}
-				else if ('}' == line[i]) {
-					--nesting_level;
-					auto item = std::find_if(scopes.begin(), scopes.end(), look_for_empty_end_of_nesting_level(nesting_level));
-					if (scopes.end() == item) {
-						printf("Closing bracked without opening one in line %d\n", lineno);
-						assert(false && "Closing bracket without opening bracket");
-						return false;
-					}
-					(*item)->_end = lineno;
-				}
-			}
-		}
-		if (1 != nesting_level) {
-			printf("Not balanced brackets in file %s\n", f.c_str());
-			printf("Number of not balanced brackets is: %d\n",
-				nesting_level - 1);
-			printf("There can be incorrect scoping in file %s\n", f.c_str());
-		}
-		//assert(1 == nesting_level && "Not balanced brackets");
-		--nesting_level;
-		scopes[0]->_end = lineno;
-		fstream.close();
-
-		for (auto &i : scopes) {
-			_scopes[file_path][i->_start] = i->_end;
-			delete i;
-		}
+		paths.push_back(file_path);
 	}
-	return true;
+	std::sort(paths.begin(), paths.end());
+	paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+	// Every file is parsed once, by whichever thread takes it first
+	std::vector<scope_t> results(paths.size());
+	std::vector<char> parsed(paths.size(), false);
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		for (size_t i = next++; i < paths.size(); i = next++)
+			parsed[i] = parse(paths[i], results[i]);
+	};
+	if (threads <= 1) {
+		worker();
+	} else {
+		std::vector<std::thread> pool;
+		for (unsigned t = 0; t < threads; ++t)
+			pool.push_back(std::thread(worker));
+		for (auto &t : pool)
+			t.join();
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < paths.size(); ++i) {
+		if (parsed[i])
+			_scopes[paths[i]].swap(results[i]);
+		else
+			ok = false;
+	}
+	return ok;
 }
@@ -6,40 +6,41 @@
 #include <map>
 #include <string>
 #include <vector>
-#include <cassert>
 
 
 struct scoping {
 	enum {NO_END_LINE = -1};
+	// Parses every source file once. Relative paths are prefixed with
+	// 'paths_prefix'. Files are spread over 'threads' threads.
 	bool init(const std::vector<std::string>& /*srcfiles*/,
-		const std::string& paths_prefix = std::string());
-	int endline(const std::string& file, int startline) const {
-		assert(scope_t() != _scopes.at(file) && "Scoping: no file");
-		if (0 == _scopes.at(file).at(startline))
-			return NO_END_LINE;
-		return _scopes.at(file).at(startline);
-	}
+		const std::string& paths_prefix = std::string(),
+		const unsigned threads = 1);
+	// Same as init but keeps the files parsed before and skips them.
+	bool add(const std::vector<std::string>& /*srcfiles*/,
+		const std::string& paths_prefix = std::string(),
+		const unsigned threads = 1);
+	// End line of the innermost scope opened at 'startline', NO_END_LINE
+	// if there is none or it is never closed.
+	int endline(const std::string& file, int startline) const;
 	// 'scope' is a lexical scope which includes declline and which
 	// left end is the closest to the declaration of all file scopes.
-	std::pair<int, int> scope(const std::string& file, int declline) {
-		const scope_t& sc = _scopes[file];
-		for(auto i = sc.rbegin(); sc.rend() != i; ++i) {
-			if (i->first > declline || i->second < declline) continue;
-			return *i;
-		}
-		return std::make_pair(0, 0);
-	}
+	std::pair<int, int> scope(const std::string& file, int declline) const;
+	// First line at or after 'line' where a scope opens, 0 if none.
+	int nextScope(const std::string& file, int line) const;
 
-	int nextScope(const std::string& file, int line) {
-		const scope_t& sc = _scopes[file];
-		for (auto i = sc.begin(); sc.end() != i; ++i) {
-			if (i->first >= line)
-			return i->first;
-		}
-		return 0;
-	}
 private:
-	typedef std::map<int, int> scope_t;
+	struct interval {
+		int start, end;		// end is NO_END_LINE if never closed
+		unsigned parent;	// index of the enclosing scope
+	};
+	// Scopes in the order they open, so sorted by start line. The first
+	// one is the whole file and is its own parent.
+	typedef std::vector<interval> scope_t;
+	static bool parse(const std::string& file_path, scope_t& scopes);
+	const scope_t *find(const std::string& file) const;
+	// Index of the innermost scope opened at or before 'line', -1 if none
+	static int last_opened(const scope_t& sc, int line);
+
 	std::map<std::string, scope_t> _scopes;
 	std::string _path_prefix;
 };
@@ -50,6 +50,8 @@ END_LEGAL */
 #include <sstream> 
 #include "pin.H"
 #include "instlib.H"
+#include "rtnselect.h"
+#include "histogram.h"
 
 using namespace INSTLIB;
 
@@ -83,64 +85,244 @@ KNOB<BOOL> KnobStackTrace(KNOB_MODE_WRITEONCE, "pintool",
 		       "trace", "0", 
 		       "set to 1 if you want to record a stack trace within the tracked function");
 
+KNOB<UINT32> KnobTraceLength(KNOB_MODE_WRITEONCE, "pintool",
+    "tracelen", "1024", "number of the most recent routine entries and exits every "
+    "thread keeps for the stack traces (rounded up to a power of 2)");
+
+KNOB<string> KnobReportFile(KNOB_MODE_WRITEONCE, "pintool",
+    "o", "", "specify a file (or named pipe) to write a line to for every straggler");
+
+KNOB<UINT32> KnobReportInterval(KNOB_MODE_WRITEONCE, "pintool",
+    "r", "1000", "report each function as a straggler at most once every that many "
+    "milliseconds (0: report every straggler)");
+
+KNOB<UINT32> KnobWarmup(KNOB_MODE_WRITEONCE, "pintool",
+    "warmup", "1000", "number of calls of a function with an adaptive threshold to time "
+    "before its threshold is learned and its stragglers caught");
+
 /* ===================================================================== */
 /* Data Structures and helper routines */
 /* ===================================================================== */
 
-/* Holds names of functions the user wants us to track.
- * Not all of them will be valid. Validity will be checked on
- * image load, which is when valid functions will get an associated
- * function record and will get put into a hashmap. 
+/* Holds the patterns on the names of functions the user wants us to
+ * track (see rtnselect.h), in the same order as the selector. They are
+ * matched on image load, which is when the matching functions will get
+ * an associated function record and will get put into the funcMap. A
+ * function matching several patterns gets the threshold of the first.
+ *
+ * The threshold is either fixed, or learned from the latencies of the
+ * function (see updateThreshold): a percentile of them, or a multiple
+ * of their median.
  */
 typedef struct func_name
 {
     string name;
-    UINT64 threshold;
+    UINT64 threshold;		// fixed, in ns
+    double percentile;		// if adaptive, or 0
+    double medianMultiple;	// if adaptive, or 0
 } FuncName;
 
 vector<FuncName*> funcNameList;
+RoutineSelector selector;
 
-/* We will allocate an array with per-thread data assuming that we will have no more than
- * 64 threads. If we do have more than 64, we will reallocate the array to accommodate the
- * larger number. 
- */
-int threadArraySize = 32;
+/* One more than the largest thread ID which has started so far. Only
+ * written with the lock held, read without it. */
 int largestUnusedThreadID = 0;
 
 #define CACHE_LINE_SIZE 64
-#define STACK_LIMIT 8192
+#define ENTRY_STACK_DEPTH 32
 
+/* A function may be running several times in a thread, if it is
+ * recursive or re-entered, so every thread keeps a stack of its
+ * running activations, outermost first. Each is timed on its own. The
+ * activations nested deeper than the stack holds are only counted in
+ * 'untracked' and not timed.
+ *
+ * Only the owning thread writes the stack and invCount, and it does so
+ * between two increments of seq, which is therefore odd while a write
+ * is in progress. The catcher thread reads them without locks and
+ * retries if seq was odd or changed in the meantime (a sequence lock),
+ * so it never sees an entry time torn from its activation. Every
+ * activation gets a number: whoever reports it as a straggler first
+ * stores the number into 'reported' at its depth, so it is reported
+ * once.
+ *
+ * With -trace, 'entryTrace' holds the position of the thread's trace
+ * when the activation was entered, so its trace starts there.
+ *
+ * For a function with an adaptive threshold, the thread also records
+ * the latencies of its calls in 'latencies', which it allocates on the
+ * first one.
+ */
 typedef struct thread_local_data
 {
-    UINT64 timeAtLastEntry;
+    UINT64 entryTime[ENTRY_STACK_DEPTH];
+    UINT64 entryTrace[ENTRY_STACK_DEPTH];
+    ADDRINT entrySP[ENTRY_STACK_DEPTH];	// stack pointer on entry
+    UINT32 activation[ENTRY_STACK_DEPTH];
+    UINT32 reported[ENTRY_STACK_DEPTH];
+    UINT32 depth;
+    UINT32 untracked;
+    UINT32 activations;		// so far, to number them
+    UINT32 seq;
     UINT64 invCount;
+    LatencyHistogram *latencies;
     char valid;
-    char stackTrace[STACK_LIMIT];
-    int stackBufPosition;
-    int droppedRecords;
-    UINT8 padding[CACHE_LINE_SIZE-sizeof(UINT64)*2-sizeof(char)-2*sizeof(int)];
-} ThrLocData; 
+} __attribute__((aligned(CACHE_LINE_SIZE))) ThrLocData; 
+
+/* With -trace, every thread writes an event to its ring buffer when it
+ * enters or leaves any routine. The ring keeps the last traceLength
+ * events. An event is a pointer to the name of the routine, which is
+ * only read when a straggler is reported, with its lowest bit set for
+ * an exit (the names are allocated, so that bit is free). The events
+ * are not timed: an activation records the position of the trace on
+ * entry instead, which is much cheaper than reading the clock on every
+ * routine entry and exit.
+ */
+typedef ADDRINT TraceEvent;
+
+UINT32 traceLength = 0;		// a power of 2
+
+typedef struct thread_data
+{
+    OS_THREAD_ID osTid;
+    UINT64 traceCount;		// events written so far
+    TraceEvent *trace;		// the last traceLength of them
+} ThreadData;
+
+/* Data of every thread by Pin thread ID. A full table is copied into a
+ * larger one and published atomically, and the old one is left in
+ * place, so it can be read without the lock. Hold the lock to grow it. 
+ */
+typedef struct thread_table
+{
+    UINT32 size;
+    ThreadData **threads;
+} ThreadTable;
 
-int totalDroppedRecords = 0; 
+ThreadTable *threadTable = new ThreadTable();
+
+ThreadData *findThreadData(THREADID threadid)
+{
+    ThreadTable *table = __atomic_load_n(&threadTable, __ATOMIC_ACQUIRE);
+
+    if(threadid >= table->size)
+	return NULL;
+    return __atomic_load_n(&table->threads[threadid], __ATOMIC_ACQUIRE);
+}
+
+VOID addThreadData(THREADID threadid, ThreadData *td)
+{
+    ThreadTable *table = threadTable;
+
+    if(threadid >= table->size)
+    {
+	ThreadTable *larger = new ThreadTable;
+
+	larger->size = table->size ? table->size * 2 : 64;
+	while(larger->size <= threadid)
+	    larger->size *= 2;
+	larger->threads = new ThreadData*[larger->size]();
+	for (UINT32 i = 0; i < table->size; i++)
+	    larger->threads[i] = table->threads[i];
+	__atomic_store_n(&threadTable, larger, __ATOMIC_RELEASE);
+	table = larger;
+    }
+    __atomic_store_n(&table->threads[threadid], td, __ATOMIC_RELEASE);
+}
 
 struct func_record;
 
+#define NO_THRESHOLD (~0ULL)
+
+/* Every function keeps the records of the threads in chunks of
+ * RECORDS_PER_CHUNK, the record of a thread being at its ID in the
+ * sequence of the chunks. A chunk is only allocated when a thread whose
+ * record it holds starts, and is never moved or freed, so the records
+ * can be read and written without the lock and growing them never loses
+ * anything. Hold the lock to allocate a chunk.
+ */
+#define RECORDS_PER_CHUNK 64
+#define RECORD_CHUNKS 512	// for 32768 threads
+
 typedef struct func_record
 {
     string name;
-    UINT64 latencyThreshold;
+    UINT64 latencyThreshold;	// NO_THRESHOLD until learned, if adaptive
+    double percentile;
+    double medianMultiple;
     string image;
     ADDRINT address;
-    ThrLocData *thrFuncRecords;
+    ThrLocData *thrFuncRecords[RECORD_CHUNKS];	// see threadRecord
+    UINT64 lastReportTime;	// of the last straggler reported
+    UINT64 suppressedReports;	// since then, because of the rate limit
 } FuncRecord;
 
-/* This where we store function records keyed by the function name. 
- * We are storing the function name twice. Get rid of the duplicate if
- * this becomes a problem. 
+/* This where we store function records, in the order they are found.
+ * The analysis routines read it without the lock, so it only grows:
+ * a full map is copied into a larger one, which is published before
+ * the size that needs it, and the old one is left for the readers
+ * still using it.
  */
-FuncRecord **funcMap;
+FuncRecord **funcMap = 0;
 int funcMapSize = 0;
-int smallestUnusedFuncMapSlot = 0;
+int funcMapCapacity = 0;
+
+/* Must hold the lock when this function is called. */
+VOID addFuncRecord(FuncRecord *fr)
+{
+    if(funcMapSize == funcMapCapacity)
+    {
+	int newCapacity = funcMapCapacity ? funcMapCapacity * 2 : 64;
+	FuncRecord **newMap = new FuncRecord*[newCapacity];
+
+	if(funcMapSize)
+	    memcpy((void*)newMap, funcMap, funcMapSize * sizeof(FuncRecord*));
+	__atomic_store_n(&funcMap, newMap, __ATOMIC_RELEASE);
+	funcMapCapacity = newCapacity;
+    }
+    funcMap[funcMapSize] = fr;
+    __atomic_store_n(&funcMapSize, funcMapSize + 1, __ATOMIC_RELEASE);
+}
+
+/* Allocates the chunk of a function's records which holds the record
+ * of a thread, if it is not there yet. Must hold the lock. */
+VOID allocThreadRecord(FuncRecord *fr, THREADID threadid)
+{
+    UINT32 chunk = threadid / RECORDS_PER_CHUNK;
+    ThrLocData *records;
+
+    if(chunk >= RECORD_CHUNKS)
+    {
+	cerr<< "INSUFFICIENT THREAD-LOCAL STORAGE FOR THREAD " << threadid 
+	    << ". ABORTING..." << endl;
+	exit(-1);
+    }
+    if(fr->thrFuncRecords[chunk])
+	return;
+
+    if(posix_memalign((void**)&records, CACHE_LINE_SIZE, 
+		      RECORDS_PER_CHUNK * sizeof(ThrLocData)))
+    {
+	cerr << "Could not allocate memory for the thread records. Aborting... " << endl;
+	exit(-1);
+    }
+    memset((void*)records, 0, RECORDS_PER_CHUNK * sizeof(ThrLocData));
+    __atomic_store_n(&fr->thrFuncRecords[chunk], records, __ATOMIC_RELEASE);
+}
+
+/* The record of a thread, or NULL if its chunk is not allocated yet. A
+ * thread always finds its own, which was allocated when it started or
+ * when the function was found. */
+inline ThrLocData *threadRecord(FuncRecord *fr, THREADID threadid)
+{
+    ThrLocData *records = __atomic_load_n(&fr->thrFuncRecords[threadid / RECORDS_PER_CHUNK],
+					  __ATOMIC_ACQUIRE);
+
+    if(records == NULL)
+	return NULL;
+    return &records[threadid % RECORDS_PER_CHUNK];
+}
 
 /* Useful for debugging. Must hold the lock when this function is called. */
 VOID printAllRecords()
@@ -158,17 +340,13 @@ VOID printAllRecords()
 	cout << fr->name << ", thr:" <<  fr->latencyThreshold << 
 	    ", img: " << fr->image << hex << ", addr: " << fr->address << dec << endl;
 
-	if(fr->thrFuncRecords){
-	    int i;
-	    
-	    for(i = 0; i < largestUnusedThreadID; i++)
-	    {
-		ThrLocData *tld = &(fr->thrFuncRecords[i]);
-		if(tld->valid)
-		    cout << "Thread: " << i << ", "<< 
-			"Time last entry: " << tld->timeAtLastEntry 
-			 << ", invCount: " << tld->invCount << endl;
-	    }
+	for(int t = 0; t < largestUnusedThreadID; t++)
+	{
+	    ThrLocData *tld = threadRecord(fr, t);
+	    if(tld && tld->valid)
+		cout << "Thread: " << t << ", "<< 
+		    "Running: " << tld->depth + tld->untracked
+		     << ", invCount: " << tld->invCount << endl;
 	}
 
 	cout << "++++++++" << endl;    
@@ -179,362 +357,604 @@ VOID printAllRecords()
 }
 
 
-/* This means we have more threads than anticipated.
- * Reallocate a larger array and copy the data from the old array 
- * into the new one. Threads might be accessing the old array while
- * we are copying the data, so we may loose some stragglers. 
- * That's ok. We don't want to be acquiring locks in the critical
- * path, so we choose to lose data on these very rare occasions. 
- * We must be holding the lock while this function is called.
- */
-int allocMoreSpaceAndCopy()
+const char * StripPath(const char * path)
 {
-    unsigned int newsize = threadArraySize * 2;
+    const char * file = strrchr(path,'/');
+    if (file)
+        return file+1;
+    else
+        return path;
+}
 
-    for (int i = 0; i < funcMapSize; i++) {
-	FuncRecord *fr = funcMap[i];
+#define BILLION 1000000000
+#define MILLION 1000000
+#define THOUSAND 1000
 
-	assert(fr->thrFuncRecords);
-	ThrLocData *newArray;
 
-	newArray = (ThrLocData *)malloc(newsize * sizeof(ThrLocData));
-	if(newArray == NULL)
-	    return -1;
+inline UINT64 timeNowNS()
+{
+    timespec ts;
 
-	memset((void*)newArray, 0, newsize * sizeof(ThrLocData));
-	memcpy((void*)newArray, fr->thrFuncRecords, threadArraySize * sizeof(ThrLocData));
-	
-	fr->thrFuncRecords = newArray;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * BILLION + ts.tv_nsec;
+}
 
-	threadArraySize = newsize;
-	cout << "Reallocated space for " << fr->name << endl;
+/* ===================================================================== */
+/* Straggler reports                                                     */
+/* ===================================================================== */
+
+/* Running the user's script takes milliseconds, so the thread which
+ * catches a straggler only puts it into a bounded lock-free queue (see
+ * enqueueReport) and the reporter thread runs the script and writes
+ * the report file. If the queue is full, the straggler is dropped. 
+ */
+#define REPORT_QUEUE_SIZE 64	// a power of 2
+
+typedef struct straggler_event
+{
+    UINT64 turn;		// see enqueueReport
+    FuncRecord *fr;
+    THREADID threadid;
+    OS_THREAD_ID osTid;		// as it was when caught, the ID may be reused
+    UINT64 timeOfEntry;
+    UINT64 timeOfExit;
+    UINT64 suppressed;		// reports of fr skipped since the last one
+    TraceEvent *trace;		// of the thread since the entry, with -trace
+    UINT32 traceEvents;
+    BOOL traceTruncated;	// older events since the entry were lost
+} StragglerEvent;
+
+StragglerEvent *reportQueue;
+UINT64 reportQueueHead = 0;	// next event to fill, shared by the producers
+UINT64 reportQueueTail = 0;	// next event to report, reporter thread only
+UINT64 droppedReports = 0;
+
+BOOL reportsProvided = FALSE;
+ofstream reportFile;
+volatile BOOL reportsDone = FALSE;
+PIN_THREAD_UID reporterThreadUid;
+
+VOID initReportQueue()
+{
+    reportQueue = new StragglerEvent[REPORT_QUEUE_SIZE];
+    for (UINT64 i = 0; i < REPORT_QUEUE_SIZE; i++)
+    {
+	reportQueue[i].turn = i;
+	reportQueue[i].trace = traceLength ? new TraceEvent[traceLength] : NULL;
     }
-    return 0;
 }
 
-/* We check if the thread-local record keeping space for each function 
- * we are tracking is there, and if not we allocate it. We find functions
- * we need to track on Image load, but sometimes a thread gets created after
- * the image is loaded. In that case, it needs to allocate the space for
- * itself. The lock must be held while we are manipulating the shared parts
- * of the function records.
+/* Copies the events of a thread's trace from position 'since' into
+ * 'out', which has room for traceLength events. The owner may be writing
+ * the ring meanwhile: the events it may have overwritten while they were
+ * copied are dropped. Returns the number of events copied. */
+UINT32 copyTrace(ThreadData *td, UINT64 since, TraceEvent *out, BOOL *truncated)
+{
+    UINT64 end = __atomic_load_n(&td->traceCount, __ATOMIC_ACQUIRE);
+    UINT64 begin = end > traceLength ? end - traceLength : 0;
+    UINT32 copied = 0;
+
+    /* The ID of the thread was reused since the entry */
+    if(since > end)
+	since = end;
+    if(begin < since)
+	begin = since;
+
+    for (UINT64 i = begin; i < end; i++)
+	out[copied++] = __atomic_load_n(&td->trace[i & (traceLength - 1)], __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    /* The owner may be writing event 'now' over event now - traceLength
+     * without having counted it yet, so that one is not safe either. */
+    UINT64 now = __atomic_load_n(&td->traceCount, __ATOMIC_RELAXED);
+    UINT64 first = now + 1 > traceLength && now + 1 - traceLength > begin ? 
+	now + 1 - traceLength : begin;
+
+    /* The events between 'since' and 'first' are lost or may be torn */
+    *truncated = first > since;
+    if(first >= end)
+	return 0;
+
+    UINT32 skip = (UINT32)(first - begin);
+    for (UINT32 i = skip; i < copied; i++)
+	out[i - skip] = out[i];
+    return copied - skip;
+}
+
+/* An event at position pos of the queue is in the slot pos % size. The
+ * slot's turn is pos when it can be filled and pos + 1 once it is, and
+ * the reporter sets it to pos + size once it is done with the event.
+ * Producers claim a position with a compare-and-swap on the head, so
+ * they never wait for each other or for the reporter. 
  */
-VOID markThreadRecValid(unsigned int threadid)
+BOOL enqueueReport(FuncRecord *fr, THREADID threadid, UINT64 timeOfEntry, 
+		   UINT64 timeOfExit, UINT64 traceOfEntry)
 {
-    assert(threadid < (uint)largestUnusedThreadID);
-    if(largestUnusedThreadID > threadArraySize)
+    StragglerEvent *ev;
+    UINT64 pos = __atomic_load_n(&reportQueueHead, __ATOMIC_RELAXED);
+
+    for(;;)
     {
-	int err = allocMoreSpaceAndCopy();
+	ev = &reportQueue[pos % REPORT_QUEUE_SIZE];
+	UINT64 turn = __atomic_load_n(&ev->turn, __ATOMIC_ACQUIRE);
 
-	if(err)
+	if(turn == pos)
 	{
-	    cerr<< "INSUFFICIENT THREAD-LOCAL STORAGE FOR " << largestUnusedThreadID 
-		<< " THREADS. ABORTING..." << endl;
-	    exit(-1);
+	    if(__atomic_compare_exchange_n(&reportQueueHead, &pos, pos + 1, TRUE,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
 	}
+	else if(turn < pos)
+	    return FALSE;	// full
+	else
+	    pos = __atomic_load_n(&reportQueueHead, __ATOMIC_RELAXED);
     }
 
+    ev->fr = fr;
+    ev->threadid = threadid;
+    ev->timeOfEntry = timeOfEntry;
+    ev->timeOfExit = timeOfExit;
+    ev->suppressed = __atomic_exchange_n(&fr->suppressedReports, 0, __ATOMIC_RELAXED);
+
+    ThreadData *td = findThreadData(threadid);
+    ev->osTid = td ? __atomic_load_n(&td->osTid, __ATOMIC_RELAXED) : 0;
+    ev->traceEvents = 0;
+    ev->traceTruncated = FALSE;
+    if(KnobStackTrace && td)
+	ev->traceEvents = copyTrace(td, traceOfEntry, ev->trace, &ev->traceTruncated);
+
+    __atomic_store_n(&ev->turn, pos + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
 
-    for (int i = 0; i < funcMapSize; i++) 
+/* The trace as the script gets it: a quoted 'name-->' for every
+ * entry and 'name<--' for every exit. */
+string decodeTrace(StragglerEvent *ev)
+{
+    string funcsCalled;
+
+    if(!KnobStackTrace)
+	return "'<stack tracing not enabled (use -trace option)>'";
+
+    if(ev->traceTruncated)
+	funcsCalled = "'<older calls not kept, see -tracelen>' ";
+    for (UINT32 i = 0; i < ev->traceEvents; i++)
     {
-	FuncRecord *fr = funcMap[i];
-	fr->thrFuncRecords[threadid].valid = 1;
+	funcsCalled += "'";
+	funcsCalled += (const char *)(ev->trace[i] & ~(ADDRINT)1);
+	funcsCalled += (ev->trace[i] & 1) ? "<--' " : "-->' ";
     }
+    return funcsCalled;
 }
 
-/* The reverse of markThreadRecValid. 
- * We mark the record invalid if the thread to whom the record belongs is exiting. 
- * That way we don't have to check the records of threads who are no longer running, 
- * and we don't waste time. 
- */
-VOID markThreadRecInvalid(unsigned int threadid)
+/* This is what we do if we catch a straggler. */
+VOID stragglerCaught(StragglerEvent *ev)
 {
-    assert(threadid < (uint)largestUnusedThreadID);
+    OS_THREAD_ID tid = ev->osTid;
+    string funcsCalled = decodeTrace(ev);
 
-    for (int i = 0; i < funcMapSize; i++) {
-	FuncRecord *fr = funcMap[i];
-	assert(fr->thrFuncRecords);
-	fr->thrFuncRecords[threadid].valid = 0;
-	totalDroppedRecords += fr->thrFuncRecords[threadid].droppedRecords;
+    if(ev->suppressed)
+	cout << ev->suppressed << " more stragglers of " << ev->fr->name 
+	     << " were not reported (see the -r option)" << endl;
+
+    if(reportFile.is_open())
+    {
+	reportFile << tid << " " << ev->fr->name << " " << ev->timeOfEntry << " "
+		   << ev->timeOfExit << " " << ev->suppressed << " " 
+		   << funcsCalled << endl;
+    }
+
+    if(scriptProvided)
+    {
+	ostringstream scriptCMD;
+
+	scriptCMD << scriptCMDPartI << " " << tid << " " << ev->fr->name << " " 
+		  << ev->timeOfEntry << " " << ev->timeOfExit << " " << funcsCalled;
+
+	if(system(scriptCMD.str().c_str()))
+	    cerr << "Couldn't invoke user-defined script from straggler catcher " << endl;
     }
 }
 
-const char * StripPath(const char * path)
+/* Reports the stragglers in the queue until the program exits */
+VOID reporterThread(void *arg)
 {
-    const char * file = strrchr(path,'/');
-    if (file)
-        return file+1;
-    else
-        return path;
-}
+    for(;;)
+    {
+	StragglerEvent *ev = &reportQueue[reportQueueTail % REPORT_QUEUE_SIZE];
 
-#define BILLION 1000000000
-#define MILLION 1000000
-#define THOUSAND 1000
+	if(__atomic_load_n(&ev->turn, __ATOMIC_ACQUIRE) != reportQueueTail + 1)
+	{
+	    /* Only stop once the queue is empty */
+	    if(reportsDone)
+		break;
+	    PIN_Sleep(10);
+	    continue;
+	}
 
+	stragglerCaught(ev);
+
+	__atomic_store_n(&ev->turn, reportQueueTail + REPORT_QUEUE_SIZE, __ATOMIC_RELEASE);
+	reportQueueTail++;
+    }
+
+    for (int i = 0; i < funcMapSize; i++)
+    {
+	FuncRecord *fr = funcMap[i];
+	if(fr->suppressedReports > 0)
+	    cout << fr->suppressedReports << " more stragglers of " << fr->name 
+		 << " were not reported (see the -r option)" << endl;
+    }
+    if(droppedReports > 0)
+	cout << "Dropped " << droppedReports << " straggler reports because the "
+	     << "reporter thread was busy" << endl;
+}
+
+/* The reporter must be done before the program exits */
+VOID PrepareForFini(VOID *v)
+{
+    reportsDone = TRUE;
+    PIN_WaitForThreadTermination(reporterThreadUid, PIN_INFINITE_TIMEOUT, NULL);
+}
 
 /* ===================================================================== */
 /* Analysis routines                                                     */
 /* ===================================================================== */
  
-/* This is what we do if we catch a straggler. */
-inline VOID stragglerCaught(FuncRecord *fr, THREADID threadid, UINT64 timeOfEntry, 
-			    UINT64 timeOfExit, char* funcsCalled)
+typedef struct straggler
 {
-    int ret;
+    FuncRecord *fr;
+    ThrLocData *tld;
+    THREADID threadid;
+    UINT32 depth;
+    UINT32 activation;
+    UINT64 timeOfEntry;
+    UINT64 traceOfEntry;
+} Straggler;
+
+/* Sequence lock on a thread's record, see ThrLocData. Only the
+ * owning thread calls these. */
+inline VOID beginRecordWrite(ThrLocData *tld)
+{
+    __atomic_store_n(&tld->seq, tld->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-    if(scriptProvided)
-    {
-	UINT maxlen = strlen(scriptCMDPartI) + strlen(fr->name.c_str()) + strlen(funcsCalled) + 100;
-	char* scriptCMD = (char *) malloc(maxlen);
-	if(scriptCMD == NULL)
-	{
-	    cerr << "Couldn't malloc " << endl;
-	    exit(-1);
-	}
-	snprintf(scriptCMD, maxlen, "%s %d %s %lu %lu %s\n",  scriptCMDPartI, 
-		 PIN_GetTid(), fr->name.c_str(), timeOfEntry, timeOfExit, funcsCalled);
+inline VOID endRecordWrite(ThrLocData *tld)
+{
+    __atomic_store_n(&tld->seq, tld->seq + 1, __ATOMIC_RELEASE);
+}
 
-	ret = system(scriptCMD);
+/* Consistent snapshot of the running activations of another thread's
+ * record: their entry times, trace positions and numbers, outermost
+ * first. Returns how many there are, 0 if the owner kept writing the
+ * record the whole time. */
+#define SNAPSHOT_TRIES 100
 
-	if(ret)
+UINT32 readActivations(ThrLocData *tld, UINT64 *entryTimes, UINT64 *entryTraces,
+			UINT32 *activations)
+{
+    for (int i = 0; i < SNAPSHOT_TRIES; i++)
+    {
+	UINT32 before = __atomic_load_n(&tld->seq, __ATOMIC_ACQUIRE);
+	if(before & 1)
+	    continue;
+
+	UINT32 depth = __atomic_load_n(&tld->depth, __ATOMIC_RELAXED);
+	if(depth > ENTRY_STACK_DEPTH)
+	    continue;
+	for (UINT32 d = 0; d < depth; d++)
 	{
-	    cerr << "Couldn't invoke user-defined script from straggler catcher " << endl;
-	    exit(-1);
+	    entryTimes[d] = __atomic_load_n(&tld->entryTime[d], __ATOMIC_RELAXED);
+	    entryTraces[d] = __atomic_load_n(&tld->entryTrace[d], __ATOMIC_RELAXED);
+	    activations[d] = __atomic_load_n(&tld->activation[d], __ATOMIC_RELAXED);
 	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if(__atomic_load_n(&tld->seq, __ATOMIC_RELAXED) == before)
+	    return depth;
     }
+    return 0;
 }
 
+/* Report a straggler unless its activation was already reported by
+ * the other of the application and the catcher thread, or the function
+ * was reported less than -r milliseconds ago. Takes no lock. */
+BOOL reportStraggler(FuncRecord *fr, ThrLocData *tld, THREADID threadid, UINT32 depth,
+		     UINT32 activation, UINT64 timeOfEntry, UINT64 traceOfEntry,
+		     UINT64 timeNow)
+{
+    if(!reportsProvided)
+	return FALSE;
 
-/* See if we caught a straggler 
- * This can race. We are trying to catch the straggler from two places:
- * application thread and the straggler catcher thread. So an application
- * thread may reset the function entry time while the catcher thread is
- * checking whether there is a strggler. We don't want to synchronize here 
- * to avoid overhead. Just check for the race condition.
- */
-inline BOOL catchStraggler(FuncRecord *fr, THREADID threadid)
-{
-    timespec timeAfter;
-    UINT64 elapsedTime, timeNow;
-    BOOL caught = FALSE;
-
-   /* The variable timeAtLastEntry may be concurrently
-    * modified by a worker thread and read by the straggler catcher thread. 
-    * We are not protecting it with a lock for performance considerations.
-    * If we did, every check for a straggler would be serialized, and this
-    * can happen very often.  
-    * That might result in a few false positives. We are willing to make
-    * that sacrifice in order to avoid locking. Locking this variable can
-    * reduce performance 1000x on some tests.
-    */
-    if(fr->thrFuncRecords[threadid].timeAtLastEntry == 0)
+    if(__atomic_exchange_n(&tld->reported[depth], activation, __ATOMIC_ACQ_REL) == activation)
 	return FALSE;
 
+    if(LOUD)
+	cout << fr->name << "  took " << timeNow - timeOfEntry << " ns." << endl; 
 
-    clock_gettime(CLOCK_MONOTONIC_RAW, &timeAfter);
-    timeNow = (timeAfter.tv_sec * BILLION + timeAfter.tv_nsec);
-    elapsedTime = timeNow -
-	fr->thrFuncRecords[threadid].timeAtLastEntry;
+    /* The catcher's timeNow is from the start of its pass, so we read
+     * the clock again: another thread may have reported since. */
+    UINT64 interval = (UINT64)KnobReportInterval.Value() * MILLION;
+    if(interval)
+    {
+	UINT64 clock = timeNowNS();
+	UINT64 last = __atomic_load_n(&fr->lastReportTime, __ATOMIC_RELAXED);
 
-    /* Checking for a possible race condition, if someone
-     * else has reset the timeAtLastEntry since we last
-     * checked it. 
-     */
-    if(elapsedTime == timeNow)
+	do
+	{
+	    if(last && clock < last + interval)
+	    {
+		__atomic_add_fetch(&fr->suppressedReports, 1, __ATOMIC_RELAXED);
+		return FALSE;
+	    }
+	}
+	while(!__atomic_compare_exchange_n(&fr->lastReportTime, &last, clock, FALSE,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    if(!enqueueReport(fr, threadid, timeOfEntry, timeNow, traceOfEntry))
+    {
+	__atomic_add_fetch(&droppedReports, 1, __ATOMIC_RELAXED);
 	return FALSE;
+    }
+    return TRUE;
+}
 
-    PIN_GetLock(&lock, PIN_ThreadId());
+/* Check from the catcher thread whether a function has been running
+ * for too long in another thread, and add each of its activations
+ * which has to 'found'. 'timeNow' must be read before the snapshot: if
+ * an activation is still running in the snapshot, it has been running
+ * for at least the elapsed time, so there are no false positives. */
+VOID catchStragglers(FuncRecord *fr, ThrLocData *tld, THREADID threadid, 
+		     UINT64 timeNow, vector<Straggler> &found)
+{
+    UINT64 entryTimes[ENTRY_STACK_DEPTH];
+    UINT64 entryTraces[ENTRY_STACK_DEPTH];
+    UINT32 activations[ENTRY_STACK_DEPTH];
 
-    if(LOUD)
-	cout << fr->name << "  took " << elapsedTime << " ns." << endl; 
+    if(!__atomic_load_n(&tld->valid, __ATOMIC_RELAXED))
+	return;
 
-    if(elapsedTime > fr->latencyThreshold)
+    UINT64 threshold = __atomic_load_n(&fr->latencyThreshold, __ATOMIC_RELAXED);
+    UINT32 depth = readActivations(tld, entryTimes, entryTraces, activations);
+    for (UINT32 d = 0; d < depth; d++)
     {
-	
-	if(KnobStackTrace)
-	    stragglerCaught(fr, threadid, 
-			    fr->thrFuncRecords[threadid].timeAtLastEntry, timeNow,
-			    (char*)&(fr->thrFuncRecords[threadid].stackTrace));
-	
-	else
-	    stragglerCaught(fr, threadid, 
-			    fr->thrFuncRecords[threadid].timeAtLastEntry, timeNow, 
-			    (char*) "'<stack tracing not enabled (use -trace option)>'");
-	caught = TRUE;
+	if(entryTimes[d] > timeNow || timeNow - entryTimes[d] <= threshold)
+	    continue;
+
+	Straggler st = {fr, tld, threadid, d, activations[d], entryTimes[d], entryTraces[d]};
+	found.push_back(st);
     }
+}
 
-    PIN_ReleaseLock(&lock);
+/* Drops the activations which ended without their exit being seen,
+ * because a longjmp or an exception unwound them (or they tail-called
+ * another function). The stack grows down, so when the function is
+ * entered with the stack pointer at 'sp', the activations entered at
+ * or below it are over, and when it exits, those entered below it. 
+ * Only the owning thread calls this, within a record write. */
+inline VOID dropUnwound(ThrLocData *tld, ADDRINT sp, BOOL entering)
+{
+    UINT32 depth = tld->depth;
+
+    if(tld->untracked)
+    {
+	/* They are all deeper than the last one on the stack */
+	if(sp < tld->entrySP[depth - 1])
+	    return;
+	tld->untracked = 0;
+    }
 
-    return caught;
+    while(depth > 0 && (tld->entrySP[depth - 1] < sp ||
+			(entering && tld->entrySP[depth - 1] == sp)))
+	depth--;
+    __atomic_store_n(&tld->depth, depth, __ATOMIC_RELAXED);
 }
 
-VOID callBefore(FuncRecord *fr)
+VOID callBefore(FuncRecord *fr, ADDRINT sp)
 {
-    timespec ts;
     THREADID threadid = PIN_ThreadId();
+    ThrLocData *tld = threadRecord(fr, threadid);
+    UINT64 timeOfEntry = timeNowNS();
+    UINT64 traceOfEntry = 0;
 
-    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-    fr->thrFuncRecords[threadid].timeAtLastEntry = ts.tv_sec * BILLION + ts.tv_nsec;
-    fr->thrFuncRecords[threadid].stackBufPosition = 0;
+    if(traceLength)
+    {
+	ThreadData *td = findThreadData(threadid);
+	if(td)
+	    traceOfEntry = td->traceCount;
+    }
+
+    beginRecordWrite(tld);
+    dropUnwound(tld, sp, TRUE);
+
+    UINT32 depth = tld->depth;
+    if(depth < ENTRY_STACK_DEPTH)
+    {
+	__atomic_store_n(&tld->entryTime[depth], timeOfEntry, __ATOMIC_RELAXED);
+	__atomic_store_n(&tld->entryTrace[depth], traceOfEntry, __ATOMIC_RELAXED);
+	__atomic_store_n(&tld->activation[depth], ++tld->activations, __ATOMIC_RELAXED);
+	tld->entrySP[depth] = sp;
+	__atomic_store_n(&tld->depth, depth + 1, __ATOMIC_RELAXED);
+    }
+    else
+	tld->untracked++;
+    endRecordWrite(tld);
 }
 
-VOID callAfter(FuncRecord *fr)
+/* Only the owning thread records into its histogram, the catcher
+ * thread reads it (see updateThreshold). */
+inline VOID recordLatency(ThrLocData *tld, UINT64 latency)
 {
+    LatencyHistogram *h = tld->latencies;
 
+    if(h == NULL)
+    {
+	h = new LatencyHistogram;
+	__atomic_store_n(&tld->latencies, h, __ATOMIC_RELEASE);
+    }
+    h->record(latency);
+}
+
+/* The application thread checks its own record, which nobody else
+ * writes, so it needs no snapshot and no lock unless it reports. */
+VOID callAfter(FuncRecord *fr, ADDRINT sp)
+{
     THREADID threadid = PIN_ThreadId();
+    ThrLocData *tld = threadRecord(fr, threadid);
+    UINT64 timeNow = timeNowNS();
+    UINT64 timeOfEntry = 0, traceOfEntry = 0;
+    UINT32 activation = 0, depth = 0;
+
+    beginRecordWrite(tld);
+    dropUnwound(tld, sp, FALSE);
+
+    /* The activation exiting is the last one on the stack, if it was
+     * entered with the same stack pointer */
+    if(tld->untracked)
+	tld->untracked--;
+    else if(tld->depth > 0 && tld->entrySP[tld->depth - 1] == sp)
+    {
+	depth = tld->depth - 1;
+	timeOfEntry = tld->entryTime[depth];
+	traceOfEntry = tld->entryTrace[depth];
+	activation = tld->activation[depth];
+	__atomic_store_n(&tld->depth, depth, __ATOMIC_RELAXED);
+    }
+    tld->invCount++;
+    endRecordWrite(tld);
 
-    catchStraggler(fr, threadid);
+    if(timeOfEntry == 0)
+	return;
 
-    fr->thrFuncRecords[threadid].invCount++;
-    fr->thrFuncRecords[threadid].timeAtLastEntry = 0;
+    if(fr->percentile || fr->medianMultiple)
+	recordLatency(tld, timeNow - timeOfEntry);
 
+    if(timeNow - timeOfEntry > __atomic_load_n(&fr->latencyThreshold, __ATOMIC_RELAXED))
+	reportStraggler(fr, tld, threadid, depth, activation, timeOfEntry, traceOfEntry, 
+			timeNow);
 }
 
 
-inline VOID writeStackRecord(FuncRecord *fr, char *rtnName, char *suffix)
+/*
+ * Called before and after every function if we are recording stack
+ * traces -- i.e., which functions were called inside the tracked
+ * function. Only the owning thread writes its ring, and publishes each
+ * event with the count.
+ */
+inline VOID traceEvent(THREADID threadid, const char *rtnName, UINT64 exit)
 {
-    THREADID threadid = PIN_ThreadId();
-    char *localBuffer = NULL;
-    int bufferCurPosition = 0, newRecordLength = 0;
-
-
-    localBuffer = (char*)&(fr->thrFuncRecords[threadid].stackTrace);
-    bufferCurPosition = fr->thrFuncRecords[threadid].stackBufPosition;
-    newRecordLength = strlen(rtnName) + strlen(suffix)+3;
+    ThreadData *td = findThreadData(threadid);
 
-    if(bufferCurPosition + newRecordLength > STACK_LIMIT)
-    {
-	if(LOUD)
-	    cerr << "About to overflow buffer. Dropping record " << endl;
-	fr->thrFuncRecords[threadid].droppedRecords++;
+    if(td == NULL)
 	return;
-    }
-
-    snprintf(localBuffer + bufferCurPosition, newRecordLength, "'%s%s' \0", rtnName, suffix);
-    /* We set the new stack position to +newRecordLength-1, because we
-     * want the next record to overwrite the null character */
-    fr->thrFuncRecords[threadid].stackBufPosition += newRecordLength-1;
 
+    __atomic_store_n(&td->trace[td->traceCount & (traceLength - 1)], 
+		     (ADDRINT)rtnName | exit, __ATOMIC_RELAXED);
+    __atomic_store_n(&td->traceCount, td->traceCount + 1, __ATOMIC_RELEASE);
 }
 
-inline VOID recordStackTraceEnter(FuncRecord *fr, char *rtnName)
+VOID stackTraceBefore(char *rtnName, THREADID threadid)
 {
-    writeStackRecord(fr, rtnName, "-->");
+    traceEvent(threadid, rtnName, 0);
 }
 
-inline VOID recordStackTraceExit(FuncRecord *fr, char *rtnName)
+VOID stackTraceAfter(char *rtnName, THREADID threadid)
 {
-    writeStackRecord(fr, rtnName, "<--");
+    traceEvent(threadid, rtnName, 1);
 }
 
-/*
- * Called before every function if we are recording stack traces
- * -- i.e., which functions were called inside the tracked function. 
- * Unfortunately, because we may track several routines, we are iterating
- * over all tracked function records. 
- */
-VOID stackTraceBefore(char *rtnName)
-{
-    THREADID tid = PIN_ThreadId();
-
-    /* We are not holding the lock while iterating
-     * over the funcMap. It is possible that some null pointers
-     * are being replaced with non-null pointers as we read them. 
-     * We assume that reading a pointer from the array is atomic
-     * on most modern architectures -- can be done in a single 
-     * instruction. If this is not the case, then this code may 
-     * race in the very beginning when we are still loading images
-     * and looking for routines to instrument. 
-     */
-
-    for (int i = 0; i < funcMapSize; i++) {
-	FuncRecord *fr = funcMap[i];
 
-	/* fr->thrFuncRecords pointer must be valid and the
-	 * record associated with this thread ID must be valid.
-	 * We don't make these checks to save time. 
-	 */
-	ThrLocData *tld = &(fr->thrFuncRecords[tid]);
 
-	if(tld->timeAtLastEntry > 0)
-	    recordStackTraceEnter(fr, rtnName);
-	
-    } 
-}
-
-VOID stackTraceAfter(char *rtnName)
+/* Learns the threshold of a function with an adaptive threshold from
+ * the latencies all the threads recorded so far, merged into 'merged'.
+ * The owners keep recording while we read their histograms, so the
+ * merged one may miss the latest calls, which does not matter for a
+ * percentile. The threshold stays NO_THRESHOLD during the warm-up.
+ */
+VOID updateThreshold(FuncRecord *fr, int threads, LatencyHistogram &merged)
 {
-    THREADID tid = PIN_ThreadId();
+    merged.reset();
+    for(int t = 0; t < threads; t++)
+    {
+	ThrLocData *tld = threadRecord(fr, t);
+	if(tld == NULL)
+	    continue;
 
-    /* Map access may race. See comment for
-     * stackTraceBefore.
-     */
-    for (int i = 0; i < funcMapSize; i++) {
-	FuncRecord *fr = funcMap[i];
+	LatencyHistogram *h = __atomic_load_n(&tld->latencies, __ATOMIC_ACQUIRE);
+	if(h)
+	    merged.add(*h);
+    }
 
-	/* fr->thrFuncRecords pointer must be valid and the
-	 * record associated with this thread ID must be valid.
-	 * We don't make these checks to save time. 
-	 */
-	ThrLocData *tld = &(fr->thrFuncRecords[tid]);
-	
-	if(tld->timeAtLastEntry > 0)
-	    recordStackTraceExit(fr, rtnName);
-	
-    } 
-}
+    if(merged.count() < KnobWarmup.Value())
+	return;
 
+    UINT64 threshold;
+    if(fr->percentile)
+	threshold = merged.percentile(fr->percentile);
+    else
+	threshold = (UINT64)(merged.percentile(50) * fr->medianMultiple);
 
+    if(fr->latencyThreshold == NO_THRESHOLD)
+	cout << "Learned a threshold of " << threshold << " ns for " << fr->name
+	     << " from " << merged.count() << " calls" << endl;
+    __atomic_store_n(&fr->latencyThreshold, threshold, __ATOMIC_RELAXED);
+}
 
 /* Should be used by the straggler-catcher thread. 
  * This fuction goes over all function records and checks if
  * there are any stragglers. 
  *
- * The thread does acquire a lock to avoid race conditions where we 
- * are modifying the thread-record structure in the application thread
- * while the straggler-catcher thread is looking at it. 
+ * It takes no lock: the records are read with a sequence lock (see
+ * ThrLocData), and the function map and the chunks of records only
+ * grow (see addFuncRecord and threadRecord). A record whose chunk is
+ * not published yet belongs to a thread which has not started. The
+ * stragglers found are reported once the pass is over. It also learns
+ * the adaptive thresholds, once per pass.
  */
 
 VOID stragglerCatcherThread(void *arg)
 {
+    vector<Straggler> found;
+    LatencyHistogram *merged = new LatencyHistogram;
 
     cout << "Straggler catcher thread is beginning..." << endl;
 
-    PIN_GetLock(&lock, PIN_ThreadId());
-    largestUnusedThreadID++; // stragger catcher will use a thread id
-    PIN_ReleaseLock(&lock);
-
     while(numAppThreads > 0)
     {
-	PIN_GetLock(&lock, PIN_ThreadId());
+	/* Read the time once per pass and before the snapshots */
+	UINT64 timeNow = timeNowNS();
+
+	int threads = __atomic_load_n(&largestUnusedThreadID, __ATOMIC_ACQUIRE);
+	int functions = __atomic_load_n(&funcMapSize, __ATOMIC_ACQUIRE);
+	FuncRecord **map = __atomic_load_n(&funcMap, __ATOMIC_ACQUIRE);
+
+	for (int i = 0; i < functions; i++) {
+	    FuncRecord *fr = map[i];
 
-	for (int i = 0; i < funcMapSize; i++) {
-	    FuncRecord *fr = funcMap[i];
+	    if(fr->percentile || fr->medianMultiple)
+		updateThreshold(fr, threads, *merged);
 	
-	    for(i = 0; i < largestUnusedThreadID; i++)
+	    for(int t = 0; t < threads; t++)
 	    {
-		ThrLocData *tld = &(fr->thrFuncRecords[i]);
-		if(tld->valid)
-		{
-		    PIN_ReleaseLock(&lock);
-		    catchStraggler(fr, i);
-		    PIN_GetLock(&lock, PIN_ThreadId());
-		}
+		ThrLocData *tld = threadRecord(fr, t);
+		if(tld)
+		    catchStragglers(fr, tld, t, timeNow, found);
 	    }
 	} 
-	PIN_ReleaseLock(&lock);
+
+	for (const Straggler &st: found)
+	    reportStraggler(st.fr, st.tld, st.threadid, st.depth, st.activation, 
+			    st.timeOfEntry, st.traceOfEntry, timeNow);
+	found.clear();
 
 	/* Now sleep for a while then try again */
 	PIN_Sleep(KnobTimeInterval.Value());
     }
 
+    delete merged;
     cout << "Straggler catcher thread is exiting..." << endl;
-    if(totalDroppedRecords > 0)
-    {
-	cout << "Dropped " << totalDroppedRecords << " stack trace records due to insufficient "
-	     << "stack buffer size (" << STACK_LIMIT << ")"<< endl;
-    }
 }
 
 VOID ApplicationStart(VOID *v)
@@ -554,16 +974,70 @@ VOID ApplicationStart(VOID *v)
 
 
 
+/* We make sure every function we are tracking has a record for a thread
+ * when it starts. We find functions we need to track on Image load, but
+ * sometimes a thread gets created after the image is loaded. The thread
+ * also empties its stacks, in case its ID was used by a thread which
+ * exited in the middle of a function; it is the owner of its records
+ * now. The lock must be held while we are manipulating the shared parts
+ * of the function records.
+ */
+VOID markThreadRecValid(THREADID threadid)
+{
+    for (int i = 0; i < funcMapSize; i++) 
+    {
+	FuncRecord *fr = funcMap[i];
+	allocThreadRecord(fr, threadid);
+
+	ThrLocData *tld = threadRecord(fr, threadid);
+	beginRecordWrite(tld);
+	__atomic_store_n(&tld->depth, 0, __ATOMIC_RELAXED);
+	tld->untracked = 0;
+	endRecordWrite(tld);
+	__atomic_store_n(&tld->valid, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* The reverse of markThreadRecValid. 
+ * We mark the record invalid if the thread to whom the record belongs is exiting. 
+ * That way we don't have to check the records of threads who are no longer running, 
+ * and we don't waste time. 
+ */
+VOID markThreadRecInvalid(THREADID threadid)
+{
+    for (int i = 0; i < funcMapSize; i++) {
+	FuncRecord *fr = funcMap[i];
+	__atomic_store_n(&threadRecord(fr, threadid)->valid, 0, __ATOMIC_RELAXED);
+    }
+}
+
 VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
 {
     BOOL startCatcher = FALSE;
 
     PIN_GetLock(&lock, threadid+1);
 
-    /* Thread IDs are monotonically increasing and are not reused
-     * if a thread exits. */
-    largestUnusedThreadID++;
+    /* A thread ID may be reused once its thread exits: the new thread
+     * then takes over the data of the old one rather than leaking it. */
+    ThreadData *td = findThreadData(threadid);
+    if(td == NULL)
+    {
+	td = new ThreadData;
+	td->trace = traceLength ? new TraceEvent[traceLength] : NULL;
+	td->osTid = PIN_GetTid();
+	td->traceCount = 0;
+	addThreadData(threadid, td);
+    }
+    else
+    {
+	__atomic_store_n(&td->osTid, PIN_GetTid(), __ATOMIC_RELAXED);
+	__atomic_store_n(&td->traceCount, 0, __ATOMIC_RELEASE);
+    }
+
+    /* The records must be there before the catcher looks for them */
     markThreadRecValid(threadid);
+    if((int)threadid >= largestUnusedThreadID)
+	__atomic_store_n(&largestUnusedThreadID, threadid + 1, __ATOMIC_RELEASE);
     numAppThreads++;
 
     if(numAppThreads == 1)
@@ -600,117 +1074,121 @@ VOID ThreadFini(THREADID threadid, const CONTEXT *ctxt, INT32 code, VOID *v)
    
 VOID Image(IMG img, VOID *v)
 {
-    /* Go over all the routines we are instrumenting and insert the
-     * instrumentation.
+    /* Go over all the routines of the image once, instrument those
+     * matching a pattern and, if we are recording stack traces, insert
+     * the stack-tracing instrumentation in all of them.
      */
-    for (FuncName* fn: funcNameList)
-    { 
-	THREADID threadid;
-	RTN rtn = RTN_FindByName(img, fn->name.c_str());
+    selector.forEachRoutine(img, [](RTN rtn, int pattern)
+    {
+	FuncRecord *fr = NULL;
 
-	if (RTN_Valid(rtn))
+	if (pattern != RoutineSelector::NO_MATCH)
 	{
-	    threadid = PIN_ThreadId();
+	    THREADID threadid = PIN_ThreadId();
 	    PIN_GetLock(&lock, threadid+1);
-	    cout << "Procedure " << fn->name << " located." << endl;
+	    cout << "Procedure " << RTN_Name(rtn) << " located." << endl;
 
 	    // Allocate a record for this routine
-	    FuncRecord * fr = new FuncRecord;
+	    fr = new FuncRecord;
 
 	    fr->name = RTN_Name(rtn);
 
 	    fr->image = StripPath(IMG_Name(SEC_Img(RTN_Sec(rtn))).c_str());
 	    fr->address = RTN_Address(rtn);
-	    fr->latencyThreshold = fn->threshold;
+	    fr->percentile = funcNameList[pattern]->percentile;
+	    fr->medianMultiple = funcNameList[pattern]->medianMultiple;
+	    if(fr->percentile || fr->medianMultiple)
+		fr->latencyThreshold = NO_THRESHOLD;
+	    else
+		fr->latencyThreshold = funcNameList[pattern]->threshold;
+	    fr->lastReportTime = 0;
+	    fr->suppressedReports = 0;
 	    
-	    // Allocate space for thread-local data
-	    fr->thrFuncRecords = (ThrLocData *)malloc(threadArraySize * sizeof(ThrLocData));
-	    if(fr->thrFuncRecords == NULL)
-	    {
-		cerr << "Could not allocate memory in Image routine. Aborting... " << endl;
-		exit(-1);
-	    }
-	    memset((void*)fr->thrFuncRecords, 0, threadArraySize * sizeof(ThrLocData));
+	    // Allocate the records of the threads started so far
+	    memset((void*)fr->thrFuncRecords, 0, sizeof(fr->thrFuncRecords));
+	    for (int t = 0; t < largestUnusedThreadID; t += RECORDS_PER_CHUNK)
+		allocThreadRecord(fr, t);
+	    allocThreadRecord(fr, threadid);
 
 	    /* Set the record valid for the current thread, because it won't have
 	     * another chance to do so -- the ThreadStart routine where this is
 	     * normally done has already run.
 	     */
 	    assert(threadid != INVALID_THREADID);
-	    assert(threadid < (uint)threadArraySize);
 
-	    fr->thrFuncRecords[threadid].valid = 1;
-
-	    // Instrument 
-	    RTN_Open(rtn);
-	    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)callBefore,
-			   IARG_PTR, fr, IARG_END);
-	    RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)callAfter,
-			   IARG_PTR, fr, IARG_END);
-	    RTN_Close(rtn);
+	    threadRecord(fr, threadid)->valid = 1;
 
 	    /* Add to the map of routines */
-	    assert(smallestUnusedFuncMapSlot < funcMapSize);
-	    funcMap[smallestUnusedFuncMapSlot++] = fr;
+	    addFuncRecord(fr);
 	    PIN_ReleaseLock(&lock);
+	}
 
+	if (fr == NULL && !KnobStackTrace)
+	    return;
 
-	}
-    } 
-    
-    if(KnobStackTrace)
-    {
-	/* Now we need to go over ALL routines in the image and insert the 
-	 * stack-tracing instrumentation */
+	RTN_Open(rtn);
 
-	/* Pass over all sections in an image */
-	for(SEC sec= IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec) )
+	// Instrument 
+	if (fr)
 	{
-	    /* Pass over all routines in a section */
-	    for(RTN rtn= SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn) )
-	    {
-		const string & rtnName = RTN_Name(rtn);
-		char *rtnName_cstr = new char[rtnName.length() + 1];
-		strcpy(rtnName_cstr, rtnName.c_str());
-
-		RTN_Open(rtn);
-		RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)stackTraceBefore,
-			       IARG_PTR, (void *)rtnName_cstr, IARG_END);
-		RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)stackTraceAfter,
-			       IARG_PTR, (void *)rtnName_cstr, IARG_END);
-		RTN_Close(rtn);
+	    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)callBefore,
+			   IARG_PTR, fr, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+	    RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)callAfter,
+			   IARG_PTR, fr, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+	}
 
-	    }
+	if (KnobStackTrace)
+	{
+	    const string & rtnName = RTN_Name(rtn);
+	    char *rtnName_cstr = new char[rtnName.length() + 1];
+	    strcpy(rtnName_cstr, rtnName.c_str());
+
+	    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)stackTraceBefore,
+			   IARG_PTR, (void *)rtnName_cstr, IARG_THREAD_ID, IARG_END);
+	    RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)stackTraceAfter,
+			   IARG_PTR, (void *)rtnName_cstr, IARG_THREAD_ID, IARG_END);
 	}
-    }
+
+	RTN_Close(rtn);
+    });
     
 }
 /* ===================================================================== */
 /* Build the list of procedures we want to instrument                    */
 /* ===================================================================== */
 
-/* We don't call this function unless we have 3 elements in the vector */
-FuncName* getFN(vector<string> elems){
-    
-    double threshold;
-
-    FuncName* fn = new FuncName;
+/* Parse an adaptive threshold: pN for the N-th percentile of the
+ * latencies, or Kx for K times their median. */
+BOOL getAdaptiveThreshold(FuncName *fn, string spec)
+{
+    if(spec.size() > 1 && spec[0] == 'p')
+    {
+	fn->percentile = atof(spec.c_str() + 1);
+	return fn->percentile > 0.0 && fn->percentile < 100.0;
+    }
+    if(spec.size() > 1 && spec[spec.size() - 1] == 'x')
+    {
+	fn->medianMultiple = atof(spec.substr(0, spec.size() - 1).c_str());
+	return fn->medianMultiple > 0.0;
+    }
+    return FALSE;
+}
 
-    /* Get function name */
-    fn->name = elems[0]; 
+/* Parse a fixed threshold: a value and its unit, in nanoseconds */
+BOOL getFixedThreshold(FuncName *fn, string value, string units)
+{
+    double threshold;
+    UINT64 multiplier;
 
     /* Get latency threshold */
-    threshold = atof(elems[1].c_str());
+    threshold = atof(value.c_str());
     if(threshold == 0.0)
     {
-	cout << "Invalid parameter for latency threshold: " << "[" << elems[1] << "]" << endl;
-	return NULL;
+	cout << "Invalid parameter for latency threshold: " << "[" << value << "]" << endl;
+	return FALSE;
     }
 
     /* Get the units for latency threshold, convert to nanoseconds */
-    string units = elems[2];
-    UINT64 multiplier;
-
     if(units.compare("s") == 0)
 	multiplier = BILLION;
     else if(units.compare("ms") == 0)
@@ -720,11 +1198,44 @@ FuncName* getFN(vector<string> elems){
     else if(units.compare("ns") == 0)
 	multiplier = 1;
     else{
-	cout << "Invalid unit specified: " << "[" << elems[2] << "]" << endl;
-	return NULL;
+	cout << "Invalid unit specified: " << "[" << units << "]" << endl;
+	return FALSE;
     }
 
     fn->threshold = (UINT64) (threshold * multiplier);
+    return TRUE;
+}
+
+/* We don't call this function unless we have 2 or 3 elements in the vector */
+FuncName* getFN(vector<string> elems){
+    
+    string error;
+
+    FuncName* fn = new FuncName;
+
+    /* Get function name pattern */
+    fn->name = elems[0]; 
+    fn->threshold = 0;
+    fn->percentile = 0.0;
+    fn->medianMultiple = 0.0;
+
+    if(elems.size() == 2)
+    {
+	if(!getAdaptiveThreshold(fn, elems[1]))
+	{
+	    cout << "Invalid adaptive threshold: " << "[" << elems[1] << "]" << endl;
+	    return NULL;
+	}
+    }
+    else if(!getFixedThreshold(fn, elems[1], elems[2]))
+	return NULL;
+
+    /* Patterns are numbered in the order of funcNameList */
+    if(selector.add(fn->name, error) == RoutineSelector::NO_MATCH)
+    {
+	cout << "Invalid function pattern: " << "[" << elems[0] << "]: " << error << endl;
+	return NULL;
+    }
     
     return fn;
 }
@@ -749,11 +1260,21 @@ int buildFuncList(ifstream& f)
 	string line;
 	
 	/* We are looking for sets of three tokens:
-	 * func name, value of threshold, time unit for threshold.
+	 * func name pattern, value of threshold, time unit for threshold.
 	 * E.g.: 
 	 *         my_func 3 s
+	 *         wt::btree::* 10 ms
 	 * which means that if my_func takes more than 3 seconds to 
-	 * run, we will catch it as a straggler. 
+	 * run, or any function of the wt::btree namespace more than
+	 * 10 milliseconds, we will catch it as a straggler. 
+	 *
+	 * Or of two tokens, with a threshold learned from the latencies
+	 * of the function:
+	 *         my_func p99.9
+	 *         my_other_func 5x
+	 * which means that we catch the calls of my_func slower than
+	 * 99.9% of them, and of my_other_func slower than 5 times their
+	 * median (see updateThreshold).
 	 * 
 	 * We may also see a set of lines like this after a straggler definition:
 	 *
@@ -777,7 +1298,7 @@ int buildFuncList(ifstream& f)
 	}
 	
 	/* Now let's check for the function runtime threshold pattern */
-	if(elems.size() == 3)
+	if(elems.size() == 2 || elems.size() == 3)
 	{
 	    FuncName *fn = getFN(elems);
 	    if(fn == NULL)
@@ -795,16 +1316,6 @@ int buildFuncList(ifstream& f)
 	
     }
 
-    /* At this point we know how many functions we are going to instrument
-     * and hence how many function records, at most, we will need. Let's
-     * allocate space for them, so the container remains fixed in the future
-     * and we can allow accessing the pointers within it without locks to
-     * avoid synchronization in a critical path.
-     */
-    funcMapSize = funcNameList.size();
-    funcMap = new FuncRecord*[funcMapSize];
-    memset((void*)funcMap, 0, funcMapSize * sizeof(FuncRecord*)); 
-
     return 0;
 
 }
@@ -828,6 +1339,12 @@ INT32 Usage()
     cerr << "In this case we will catch my_func() as a straggler if it runs for "
 	 << " more than 3 nanoseconds." << endl;
     cerr << "Valid units are: s, ms, us, ns." << endl;
+    cerr << "The threshold may instead be learned from the latencies of the function, "
+	 << "after -warmup calls: <func_name> p<percentile>, as in my_func p99.9, or "
+	 << "<func_name> <k>x for k times their median, as in my_func 5x." << endl;
+    cerr << "The function name may also be a glob on the demangled name, as in "
+	 << "wt::btree::*, a /regex/, and may be preceded by a glob on the "
+	 << "image and a '!', as in libwiredtiger*!__wt_*." << endl;
     cerr << endl;
     
     return -1;
@@ -869,6 +1386,36 @@ int main(int argc, char *argv[])
 	snprintf(scriptCMDPartI, cmdLen, "%s %d", KnobScriptPath.Value().c_str(), getpid());
     }
 
+    if(KnobStackTrace)
+    {
+	for (traceLength = 1; traceLength < KnobTraceLength.Value(); traceLength *= 2)
+	    ;
+    }
+
+    if(KnobReportFile.Value().size() > 0)
+    {
+	reportFile.open(KnobReportFile.Value().c_str());
+	if(!reportFile.is_open())
+	{
+	    cerr << "Couldn't open " << KnobReportFile.Value() << endl;
+	    exit(-1);
+	}
+    }
+
+    reportsProvided = scriptProvided || reportFile.is_open();
+    if(reportsProvided)
+    {
+	/* Spawn the thread that will report the stragglers */
+	initReportQueue();
+	if(PIN_SpawnInternalThread(reporterThread, 0, 0, &reporterThreadUid) ==
+	   INVALID_THREADID)
+	{
+	    cerr << "Straggler reporter thread could not be created..." << endl;
+	    exit(1);
+	}
+	PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+    }
+
     /* Register Image to be called to instrument functions.*/
     IMG_AddInstrumentFunction(Image, 0);
 
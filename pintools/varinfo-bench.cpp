@@ -0,0 +1,192 @@
+/// Measures how long VarInfo takes to load the debug info of a binary,
+/// how much memory its tables take and how fast the queries are.
+///
+/// Usage: varinfo-bench [-t threads] [-c cache_dir] [-l] [-n repeat]
+///                      [-p query_threads] <binary> [queries]
+///
+/// The queries file has one query per line: "<file> <line> <name> [offset]"
+/// with the full path of the source file, as memtracker passes them. Every
+/// query asks for the type and, if an offset is given, for the field name.
+///
+/// With -p the queries are then repeated by that many threads at once,
+/// and every answer is checked against the single-threaded one.
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include "varinfo.hpp"
+
+namespace {
+	struct Query {
+		std::string file;
+		size_t line;
+		std::string name;
+		long offset;	// -1 if only the type is asked
+		std::string type, field;	// answers of the first round
+	};
+
+	double now() {
+		struct timeval tv;
+		gettimeofday(&tv, 0);
+		return tv.tv_sec + tv.tv_usec / 1e6;
+	}
+
+	// Resident set size in KB
+	long rss() {
+		long pages = 0, resident = 0;
+		FILE *f = fopen("/proc/self/statm", "r");
+		if (!f)
+			return 0;
+		if (2 != fscanf(f, "%ld %ld", &pages, &resident))
+			resident = 0;
+		fclose(f);
+		return resident * (sysconf(_SC_PAGESIZE) / 1024);
+	}
+
+	void usage(const char *name) {
+		std::cerr << "Usage: " << name << " [-t threads] [-c cache_dir] [-l] "
+			"[-n repeat] [-p query_threads] <binary> [queries]" << std::endl;
+		exit(-1);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	unsigned threads = 1;
+	unsigned repeat = 10;
+	unsigned query_threads = 1;
+	std::string cache_dir;
+	bool lazy = false;
+
+	int c;
+	while (-1 != (c = getopt(argc, argv, "t:c:ln:p:"))) {
+		switch (c) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'l':
+			lazy = true;
+			break;
+		case 'n':
+			repeat = atoi(optarg);
+			break;
+		case 'p':
+			query_threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+
+	std::vector<Query> queries;
+	if (optind + 1 < argc) {
+		std::ifstream in(argv[optind + 1]);
+		if (!in.is_open()) {
+			std::cerr << "Cannot open " << argv[optind + 1] << std::endl;
+			exit(-1);
+		}
+		std::string line;
+		while (std::getline(in, line)) {
+			std::istringstream ss(line);
+			Query q;
+			q.offset = -1;
+			if (ss >> q.file >> q.line >> q.name) {
+				ss >> q.offset;
+				queries.push_back(q);
+			}
+		}
+	}
+
+	const long rss_before = rss();
+	const double start = now();
+	VarInfo vi;
+	vi.setThreads(threads);
+	vi.setCacheDir(cache_dir);
+	vi.setLazy(lazy);
+	if (!vi.init(argv[optind])) {
+		std::cerr << "Failed to initialize VarInfo for " << argv[optind] << std::endl;
+		exit(-1);
+	}
+	const double init_time = now() - start;
+	std::cout << "init: " << init_time * 1000 << " ms" << std::endl;
+	std::cout << "tables: " << vi.memoryUsage() / 1024 << " KB, rss growth: "
+		<< rss() - rss_before << " KB" << std::endl;
+
+	if (queries.empty())
+		return 0;
+
+	// The first round loads the CUs in the lazy mode, so it is timed apart
+	size_t known = 0;
+	double round_start = now();
+	for (auto q = queries.begin(); queries.end() != q; ++q) {
+		q->type = vi.type(q->file, q->line, q->name);
+		if ("<Unknown>" != q->type)
+			++known;
+		if (q->offset >= 0)
+			q->field = vi.fieldname(q->file, q->line, q->name, q->offset);
+	}
+	const double first_round = now() - round_start;
+
+	round_start = now();
+	for (unsigned r = 0; r < repeat; ++r) {
+		for (auto q = queries.begin(); queries.end() != q; ++q) {
+			vi.type(q->file, q->line, q->name);
+			if (q->offset >= 0)
+				vi.fieldname(q->file, q->line, q->name, q->offset);
+		}
+	}
+	const double rounds = now() - round_start;
+
+	std::cout << "queries: " << queries.size() << ", resolved: " << known
+		<< std::endl;
+	std::cout << "first round: " << first_round * 1e9 / queries.size()
+		<< " ns/query" << std::endl;
+	if (repeat) {
+		std::cout << "next rounds: " << rounds * 1e9 / (repeat * queries.size())
+			<< " ns/query" << std::endl;
+	}
+	std::cout << "tables after queries: " << vi.memoryUsage() / 1024 << " KB"
+		<< std::endl;
+
+	if (query_threads <= 1 || !repeat)
+		return 0;
+
+	// Every thread runs all the rounds, starting at its own query
+	std::atomic<size_t> mismatches(0);
+	std::vector<std::thread> pool;
+	const double stress_start = now();
+	for (unsigned t = 0; t < query_threads; ++t) {
+		pool.push_back(std::thread([&vi, &queries, &mismatches, repeat, query_threads, t]() {
+			size_t bad = 0;
+			const size_t n = queries.size();
+			for (size_t i = 0; i < repeat * n; ++i) {
+				const Query& q = queries[(i + t * n / query_threads) % n];
+				if (q.type != vi.type(q.file, q.line, q.name))
+					++bad;
+				if (q.offset >= 0 &&
+					q.field != vi.fieldname(q.file, q.line, q.name, q.offset))
+					++bad;
+			}
+			mismatches += bad;
+		}));
+	}
+	for (auto &t : pool)
+		t.join();
+	const double stress = now() - stress_start;
+	const double total = static_cast<double>(query_threads) * repeat * queries.size();
+	std::cout << query_threads << " threads: " << stress * 1e9 * query_threads / total
+		<< " ns/query per thread, " << total / stress / 1e6 << " Mqueries/s, "
+		<< mismatches << " mismatches" << std::endl;
+	return mismatches ? 1 : 0;
+}
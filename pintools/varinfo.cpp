@@ -9,16 +9,19 @@
 #ifdef __linux
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #endif // __linux
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #ifdef __linux
 #include <fcntl.h>
 #include <libelf.h>
 #include <libdwarf.h>
+#include <dwarf.h>
 #include <gelf.h>
 #endif // __linux
 
@@ -27,9 +30,12 @@
 #include <vector>
 #include <string>
 #include <cassert>
-#include <sstream>
 #include <algorithm>
 #include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 #include "varinfo.hpp"
 #include "scoping.h"
@@ -44,32 +50,158 @@
 #endif
 
 namespace {
+	// Value of the 32-bit ids and fields below that are not set
+	static const uint32_t NOT_SET = 0xffffffffu;
+
+	size_t hash_string(const char *s, const size_t len) {
+		uint64_t h = 14695981039346656037ull;	// FNV-1a
+		for (size_t i = 0; i < len; ++i) {
+			h ^= (unsigned char)s[i];
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	size_t hash_ids(uint64_t key) {
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdull;
+		key ^= key >> 33;
+		return key;
+	}
+
+	// Open addressing hash table of 32-bit ids with linear probing. Keys
+	// are not kept in the table: callers pass the hash of the key and
+	// compare the ids with their own records, so the table is a single
+	// flat array.
+	class IdTable {
+	public:
+		IdTable() : _count(0) {}
+
+		template <class Eq>
+		uint32_t find(const size_t hash, Eq eq) const {
+			if (_slots.empty())
+				return NOT_SET;
+			const size_t mask = _slots.size() - 1;
+			for (size_t i = hash & mask;; i = (i + 1) & mask) {
+				if (NOT_SET == _slots[i] || eq(_slots[i]))
+					return _slots[i];
+			}
+		}
+
+		// 'id' must not be in the table. 'hash_of' gives the hashes of the
+		// ids already in the table when it grows.
+		template <class Hash>
+		void insert(const size_t hash, const uint32_t id, Hash hash_of) {
+			if (4 * (_count + 1) > 3 * _slots.size()) {
+				std::vector<uint32_t> old(_slots.empty() ? 16 : 2 * _slots.size(),
+					NOT_SET);
+				old.swap(_slots);
+				for (auto i = old.begin(); old.end() != i; ++i) {
+					if (NOT_SET != *i)
+						place(hash_of(*i), *i);
+				}
+			}
+			place(hash, id);
+			++_count;
+		}
+
+		void clear() {
+			std::vector<uint32_t>().swap(_slots);
+			_count = 0;
+		}
+		size_t memory() const { return _slots.capacity() * sizeof(uint32_t); }
+
+	private:
+		void place(const size_t hash, const uint32_t id) {
+			const size_t mask = _slots.size() - 1;
+			size_t i = hash & mask;
+			while (NOT_SET != _slots[i])
+				i = (i + 1) & mask;
+			_slots[i] = id;
+		}
+
+		std::vector<uint32_t> _slots;
+		size_t _count;
+	};
+
+	// Interned strings. Every distinct string is stored once in a flat
+	// arena and is named by its offset there; 0 is the empty string.
+	class StringPool {
+	public:
+		StringPool() : _chars(1, '\0') {}
+
+		uint32_t intern(const char *s) {
+			const size_t len = strlen(s);
+			uint32_t id = find(s, len);
+			if (NOT_SET != id)
+				return id;
+			id = _chars.size();
+			_chars.insert(_chars.end(), s, s + len + 1);
+			_ids.insert(hash_string(s, len), id, [this](const uint32_t i) {
+				return hash_string(str(i), strlen(str(i)));
+			});
+			return id;
+		}
+		uint32_t intern(const std::string& s) { return intern(s.c_str()); }
+
+		// NOT_SET if the string was never interned
+		uint32_t find(const char *s, const size_t len) const {
+			if (0 == len)
+				return 0;
+			return _ids.find(hash_string(s, len), [this, s, len](const uint32_t i) {
+				return 0 == memcmp(str(i), s, len) && '\0' == _chars[i + len];
+			});
+		}
+		uint32_t find(const std::string& s) const { return find(s.c_str(), s.size()); }
+
+		// The pointer is valid until the next intern()
+		const char *str(const uint32_t id) const { return &_chars[id]; }
+
+		const std::vector<char>& chars() const { return _chars; }
+		// Replaces the pool with 'size' bytes of NUL terminated strings
+		void assign(const char *chars, const size_t size) {
+			_chars.assign(chars, chars + size);
+			_ids.clear();
+			for (size_t i = 1; i < _chars.size(); i += strlen(str(i)) + 1) {
+				_ids.insert(hash_string(str(i), strlen(str(i))), i,
+					[this](const uint32_t j) {
+						return hash_string(str(j), strlen(str(j)));
+					});
+			}
+		}
+		size_t memory() const { return _chars.capacity() + _ids.memory(); }
+
+	private:
+		std::vector<char> _chars;
+		IdTable _ids;
+	};
+
 	// BaseTypes describe build-in and derived system data types like
 	// "int", "char", etc. Base types are identified by an offset in
 	//.debug_info section. Offsets are defined per compilation unit.
 	struct basetype_desc {
-		size_t size;
-		size_t count;
-		std::string name;
+		uint32_t offset;		// DIE offset in the compilation unit
+		uint32_t size;
+		uint32_t count;
+		uint32_t name;			// @sa StringPool
+		uint32_t next;			// offset of the referred type, 0 for named types
+		const char *suffix;		// intermediate base type modifier such as const or 'pointer'
 	};
 
-	typedef std::map<size_t, basetype_desc> BaseTypesFile_t;
-	typedef std::map<std::string, BaseTypesFile_t> BaseTypes_t;
-
-	// int - hash(type offset + file name)
-	auto hasher = std::hash<std::string>();
-	struct fieldname_desc {
-		size_t typeoffset;
-		std::string name;
+	// A field of a structure as found in .debug_info
+	struct member_desc {
+		uint32_t str_offset;	// offset of the structure type
+		uint32_t offset;		// offset of the field in the structure
+		uint32_t type;			// offset of the field type
+		uint32_t name;
 	};
-	typedef std::map<unsigned, fieldname_desc> FieldsNames_t;
-	typedef std::map<int, FieldsNames_t> StructFields_t;
 
-	// BaseType suffix describes intermediate base type modifier such as const or 'pointer'
-	typedef std::map<size_t, std::string> BaseTypeSuffixFile_t;
-	typedef std::map<std::string, BaseTypeSuffixFile_t> BaseTypeSuffix_t;
-	// SrcFiles describe source files described in .debug_info section.
-	typedef std::map<size_t, std::string> SrcFiles_t;
+	// Types of one compilation unit, in the order of the DIEs. Only kept
+	// until the types of the variables are resolved.
+	struct CUTypes {
+		std::vector<basetype_desc> types;
+		std::vector<member_desc> members;
+	};
 
 	// @sa ::validate_member
 	enum {
@@ -78,132 +210,82 @@ namespace {
 			VRES_UNKNOWN = -3,
 		};
 
-	// Variables describe every variable declared in a program
-	struct Variable {
-		enum {VALUE_NOT_SET = -1};
-		Variable(SrcFiles_t *const srcfiles,
-			BaseTypes_t *const basetypes,
-			BaseTypeSuffix_t *const basetypesuffix) :
-			_srcfiles(srcfiles), _basetypes(basetypes),
-			_basetypesuffix(basetypesuffix),
-			_line(VALUE_NOT_SET), _vis_ended_line(VALUE_NOT_SET),
-			_file_id(VALUE_NOT_SET), _type_offset(VALUE_NOT_SET) {};
-
-		void setLine(size_t line) { _line = line; }
-		void setFile(const std::string& file) {
-			auto it = _srcfiles->end();
-			for (it = _srcfiles->begin(); _srcfiles->end() != it; ++it) {
-				if (file == it->second) {
-					_file_id = it->first;
-					break;
-				}
-			}
-			if (_srcfiles->end() == it) {
-				(*_srcfiles)[_srcfiles->size()] = file;
-				_file_id = _srcfiles->size() - 1;
-			}
+	// Chains of base types are followed at most max_refs times
+	// (@sa VarInfo::Imp::resolve_chain)
+	static const int max_refs = 256;
+
+	// A field of a structure with its type already resolved
+	struct field_layout {
+		uint32_t offset;	// offset of the field in the structure
+		uint32_t size;		// size of the field type (or of an array element)
+		uint32_t count;		// number of array elements, 0 if not an array
+		uint32_t name;
+	};
+
+	// A type after the chain of typedefs, pointers and modifiers is
+	// followed down to the named type. Built once by
+	// VarInfo::Imp::resolve_types so that queries don't walk the chains.
+	// Equal types of different compilation units share one entry.
+	struct resolved_type {
+		uint32_t name;		// full name, e.g. "mytype const*"
+		uint32_t fields;	// layout of the named type, NOT_SET if none
+	};
+
+	// Checks whether 'in_str_offset' points into the field, and if the
+	// field is an array returns the element index.
+	int validate_member(const size_t in_str_offset, const field_layout& field) {
+		if (0 == field.count) {
+			if (in_str_offset < size_t(field.offset) + field.size)
+				return VRES_NESTED_STRUCTURE;
+			else
+				return VRES_UNKNOWN;
 		}
-		inline void setVisEndLine(size_t vis_end_line) {
+
+		if (field.size &&
+			(in_str_offset < size_t(field.size) * field.count) &&
+			(in_str_offset % field.size == 0))
+			return in_str_offset / field.size;
+		return VRES_NOT_ARRAY;
+	}
+
+	// Variables describe every variable declared in a program. Names
+	// and files are ids (@sa StringPool, VarInfo::Imp::_src_files).
+	struct Variable {
+		Variable(const uint32_t cu) :
+			_line(NOT_SET), _vis_ended_line(NOT_SET),
+			_file_id(NOT_SET), _name(0), _type_offset(NOT_SET),
+			_cu(cu), _type(NOT_SET), _param(false) {};
+
+		inline void setLine(uint32_t line) { _line = line; }
+		inline void setFile(uint32_t file_id) { _file_id = file_id; }
+		inline void setVisEndLine(uint32_t vis_end_line) {
 			_vis_ended_line = vis_end_line;
 		};
-		inline void setName(const std::string& name) { _name = name; }
-		inline void setTypeOffset(size_t type_offset) {
+		inline void setName(uint32_t name) { _name = name; }
+		inline void setTypeOffset(uint32_t type_offset) {
 			 _type_offset = type_offset;
 		}
-
-		inline size_t line() const { return _line; }
-		inline size_t visEndsLine() const { return _vis_ended_line; }
-		const std::string& file() const {
-			return (*_srcfiles).at(_file_id);
-		}
-		inline const std::string& name() const { return _name; }
-		const std::string type() const {
-			size_t current_offset = _type_offset;
-			static const int max_refs = 256;
-			int i = max_refs;	
-			int next_offset = 0;
-			//printf("TYPING: %d\n", current_offset);
-			std::string suffix;
-			do {
-				std::stringstream ss((*_basetypes)[file()][current_offset].name);
-				ss >> next_offset;
-
-				//printf("TYPING: %d\n", next_offset);
-				if (ss.rdstate() & std::ios::failbit) {
-					if ((*_basetypes)[file()][current_offset].name.empty())
-						return "void" + (suffix.empty() ? "*" : suffix);
-					else
-						return (*_basetypes)[file()][current_offset].name +
-							suffix;
-				}
-				suffix = (*_basetypesuffix)[file()][current_offset] +
-					suffix;
-				current_offset = next_offset;
-			} while(--i > 0);
-			return std::string();
-		}
-	
-		int validate_member(const size_t in_str_offset, const size_t type_offset, const size_t nearest_field_offset) const {
-			unsigned tsize = 0, tcount = 0;
-
-			size_t current_offset = type_offset;
-			static const int max_refs = 256;
-			int i = max_refs;	
-			int next_offset = 0;
-			do {
-				const auto& str = (*_basetypes)[file()][current_offset];
-				if (!tcount && str.count)
-					tcount = str.count;
-				if (!tsize && str.size)
-					tsize = str.size;
-					
-				std::stringstream ss(str.name);
-				ss >> next_offset;
-				if (0 == next_offset)
-					break;;
-				current_offset = next_offset;
-			} while(--i > 0);
-			if (0 == tcount) {
-				if (in_str_offset < nearest_field_offset + tsize)
-					return VRES_NESTED_STRUCTURE;
-				else
-					return VRES_UNKNOWN;
-			}
-
-			if ((in_str_offset < tsize * tcount) &&
-				(in_str_offset % tsize == 0))
-				return in_str_offset / tsize;
-			return VRES_NOT_ARRAY;
-		}
-
-		inline size_t type_offset() const { return _type_offset; }
-		// Go to chain of types to get to a main type
-		// `typedef struct { int a, int b; } mytype;`
-		const size_t get_top_offset() const {
-			size_t current_offset = _type_offset;
-			static const int max_refs = 256;
-			int i = max_refs;	
-			int next_offset = 0;
-			do {
-				std::stringstream ss((*_basetypes)[file()][current_offset].name);
-				ss >> next_offset;
-				if (0 == next_offset)
-					return current_offset;
-				current_offset = next_offset;
-			} while(--i > 0);
-			return _type_offset;
-	
-		}
+		inline void setCU(uint32_t cu) { _cu = cu; }
+		inline void setType(uint32_t type) { _type = type; }
+		inline void setParam() { _param = true; }
+
+		inline uint32_t line() const { return _line; }
+		inline uint32_t visEndsLine() const { return _vis_ended_line; }
+		inline uint32_t file_id() const { return _file_id; }
+		inline uint32_t name() const { return _name; }
+		inline uint32_t type_offset() const { return _type_offset; }
+		inline uint32_t cu() const { return _cu; }
+		inline uint32_t type() const { return _type; }
+		inline bool param() const { return _param; }
 	private:
-		SrcFiles_t*		_srcfiles;
-		BaseTypes_t*	_basetypes;
-		BaseTypeSuffix_t* _basetypesuffix;
-
-		size_t		_line;			// declaration line (start of the scope for the arguments)
-		size_t		_vis_ended_line;// line where local visibility of the var ends
-		size_t		_file_id;		// declaration file id (@sa SrcFiles_t::first)
-		std::string	_name;			// variable name
-		size_t		_type_offset;	// type description offset (@sa BaseTypes_t::first)
+		uint32_t	_line;			// declaration line (start of the scope for the arguments)
+		uint32_t	_vis_ended_line;// line where local visibility of the var ends
+		uint32_t	_file_id;		// declaration file id (@sa VarInfo::Imp::_src_files)
+		uint32_t	_name;			// variable name (@sa StringPool)
+		uint32_t	_type_offset;	// type description offset (@sa basetype_desc::offset)
+		uint32_t	_cu;			// compilation unit id (@sa VarInfo::Imp::_cu_files)
+		uint32_t	_type;			// resolved type id (@sa resolved_type)
+		bool		_param;			// formal parameter, its scope starts at the next '{'
 	};
 
 	typedef std::vector<Variable> Vars_t;
@@ -212,114 +294,598 @@ namespace {
 
 class VarInfo::Imp {
 public:
-	bool init(const std::string&);
+	Imp() : _cur_cu(0), _lazy(false), _ready(false), _worker(0), _workers(1), _cu_count(0) {
+#ifdef __linux
+		_lazy_fd = -1;
+		_lazy_elf = 0;
+		_lazy_dbg = 0;
+#endif // __linux
+	}
+	~Imp() {
+#ifdef __linux
+		close_lazy();
+		for (auto i = _lazy_files.begin(); _lazy_files.end() != i; ++i)
+			delete i->second.tables.load(std::memory_order_relaxed);
+#endif // __linux
+	}
+
+	// The tables are published to the queries once they are built
+	bool init(const std::string& file, const unsigned threads,
+		const std::string& cache_dir, const bool lazy) {
+		if (!build(file, threads, cache_dir, lazy))
+			return false;
+		_ready.store(true, std::memory_order_release);
+		return true;
+	}
+
+	// Runs the query 'q' on the tables. Once built they don't change, so
+	// the queries read them without any lock. In the lazy mode every
+	// source file gets its own tables, built the first time the file is
+	// queried and published through its entry of _lazy_files, which is
+	// not changed after init: only the queries that load a file take
+	// _load_lock (@sa load_file).
+	template <class Query>
+	const std::string query(const std::string& file, Query q) {
+		if (!_ready.load(std::memory_order_acquire))
+			return "<Unknown>";
+		if (!_lazy)
+			return q(*this);
+#ifdef __linux
+		auto it = _lazy_files.find(file);
+		if (_lazy_files.end() == it)
+			return "<Unknown>";
+		const Imp *tables = it->second.tables.load(std::memory_order_acquire);
+		if (!tables) {
+			std::lock_guard<std::mutex> guard(_load_lock);
+			tables = it->second.tables.load(std::memory_order_relaxed);
+			if (!tables) {
+				tables = load_file(it->second.cus);
+				it->second.tables.store(tables, std::memory_order_release);
+			}
+		}
+		return q(*tables);
+#else // __linux
+		return "<Unknown>";
+#endif // __linux
+	}
 
 	const std::string fieldname(const std::string &file, const size_t line, const std::string &name,
 		const unsigned offset) const {
 
 		const Variable *const var = get_var(file, line, name);
-		if (!var)
+		if (!var || NOT_SET == var->type())
 			return "<Unknown>";
-		int hash = hasher(var->file() + std::to_string(var->get_top_offset()));
-		//printf("REQUIRES: off=%d file=%s\n", var->get_top_offset(),
-		//	var->file().c_str());
-		
-		//unsigned __off = _struct_fields[hash][offset].typeoffset;
-		const auto &str = _struct_fields[hash];
-		//for (auto j : str) {
-		//	printf("<%u> %s\n", j.first, j.second.name.c_str());
-		//}
-		auto i = str.rbegin();
-		for (; str.rend() != i; ++i) {
-			if (i->first <= offset) break;
-		}
-		if (str.rend() == i)
+		const resolved_type& t = _types[var->type()];
+		if (NOT_SET == t.fields)
+			return "<Unknown>";
+
+		// The nearest field at or before the offset
+		const auto begin = _fields.begin() + _layout_starts[t.fields];
+		const auto end = _fields.begin() + _layout_starts[t.fields + 1];
+		auto i = std::upper_bound(begin, end, offset,
+			[](const unsigned o, const field_layout& f) {
+				return o < f.offset;
+			});
+		if (begin == i)
 			return "<Unknown>";
-		int idx = var->validate_member(offset, i->second.typeoffset, i->first);
+		--i;
+		const std::string field_name = _strings.str(i->name);
+		int idx = validate_member(offset, *i);
 		if (VRES_NOT_ARRAY == idx) {
-			if (i->first == offset)
-				return i->second.name;
+			if (i->offset == offset)
+				return field_name;
 			else
 				return "<Unknown>";
 		}
 		else if (VRES_NESTED_STRUCTURE == idx)
-			return i->second.name;
+			return field_name;
 		else if (VRES_UNKNOWN == idx)
 			return "<Unknown>";
-		return i->second.name + "[" + std::to_string(idx) + "]";
+		return field_name + "[" + std::to_string(idx) + "]";
 	}
 
 	const std::string type(const std::string& file,
 		const size_t line,
 		const std::string& name) const {
 		const Variable *const var = get_var(file, line, name);
-		if (!!var)
-			return var->type();
+		if (!!var && NOT_SET != var->type())
+			return _strings.str(_types[var->type()].name);
 		return "<Unknown>";
 	}
+
+	size_t memory_usage() const {
+		size_t bytes = memory();
+#ifdef __linux
+		for (auto i = _lazy_files.begin(); _lazy_files.end() != i; ++i) {
+			const Imp *tables = i->second.tables.load(std::memory_order_acquire);
+			if (tables)
+				bytes += tables->memory();
+		}
+#endif // __linux
+		return bytes;
+	}
+
 private:
+	bool build(const std::string&, const unsigned threads,
+		const std::string& cache_dir, const bool lazy);
+
+	// Only the tables the queries read are kept once they are built
+	void release_build_state() {
+		_type_ids.clear();
+		_layout_ids.clear();
+		std::vector<std::string>().swap(_cu_files);
+		std::unordered_map<std::string, unsigned>().swap(_cu_ids);
+		std::vector<std::pair<unsigned, size_t> >().swap(_cu_var_starts);
+		_scoping = scoping();
+	}
+
+	// Bytes taken by the tables
+	size_t memory() const {
+		return _strings.memory() +
+			_vars.capacity() * sizeof(Variable) +
+			_var_order.capacity() * sizeof(uint32_t) +
+			_src_files.capacity() * sizeof(uint32_t) +
+			_src_file_ids.memory() +
+			_types.capacity() * sizeof(resolved_type) +
+			_type_ids.memory() +
+			_fields.capacity() * sizeof(field_layout) +
+			_layout_starts.capacity() * sizeof(uint32_t) +
+			_layout_ids.memory();
+	}
+
+	// Of all the variables with this name declared in the file, returns
+	// the one with the closest declaration line before 'line' whose scope
+	// still covers 'line'.
 	const Variable *const get_var(const std::string& file,
 		const size_t line, const std::string& name) const {
- 
-		std::map<size_t, Variable*> variants;
-		for (unsigned i = 0; i < _vars.size(); ++i) {
-			Variable *const v = const_cast<Variable *const>(&_vars[i]);
-			if (v->line() <= line && line <= v->visEndsLine() &&
-				 name == v->name() && file == v->file()) {
-				
-				variants[v->line()] = v;
-			}
+
+		const uint32_t file_id = find_src_file(file);
+		const uint32_t name_id = _strings.find(name);
+		if (NOT_SET == file_id || NOT_SET == name_id)
+			return 0;
+
+		// _var_order is sorted by (file, name, line)
+		auto i = std::upper_bound(_var_order.begin(), _var_order.end(), 0u,
+			[this, file_id, name_id, line](const uint32_t, const uint32_t id) {
+				const Variable& v = _vars[id];
+				if (file_id != v.file_id())
+					return file_id < v.file_id();
+				if (name_id != v.name())
+					return name_id < v.name();
+				return line < v.line();
+			});
+		while (_var_order.begin() != i) {
+			--i;
+			const Variable& v = _vars[*i];
+			if (file_id != v.file_id() || name_id != v.name())
+				break;
+			if (line <= v.visEndsLine())
+				return &v;
 		}
-#ifndef __linux
-#pragma warning(suppress : 4172)
-#endif
-		if (0 != variants.size())
-			return variants.rbegin()->second;
 		return 0;
 	}
 
+	// Adds the variables from 'first_var' on to _var_order.
+	void build_index(const size_t first_var = 0) {
+		if (0 == first_var)
+			_var_order.clear();
+		const size_t old_size = _var_order.size();
+		for (size_t i = first_var; i < _vars.size(); ++i) {
+			if (NOT_SET != _vars[i].file_id())
+				_var_order.push_back(i);
+		}
+		// Variables declared on the same line keep the order they were
+		// found in.
+		auto less = [this](const uint32_t a, const uint32_t b) {
+			const Variable& va = _vars[a];
+			const Variable& vb = _vars[b];
+			if (va.file_id() != vb.file_id())
+				return va.file_id() < vb.file_id();
+			if (va.name() != vb.name())
+				return va.name() < vb.name();
+			if (va.line() != vb.line())
+				return va.line() < vb.line();
+			return a < b;
+		};
+		std::sort(_var_order.begin() + old_size, _var_order.end(), less);
+		std::inplace_merge(_var_order.begin(), _var_order.begin() + old_size,
+			_var_order.end(), less);
+	}
+
+	// Id of a source file (@sa _src_files), NOT_SET if unknown
+	uint32_t find_src_file(const std::string& file) const {
+		const uint32_t name = _strings.find(file);
+		if (NOT_SET == name)
+			return NOT_SET;
+		return _src_file_ids.find(hash_ids(name), [this, name](const uint32_t id) {
+			return _src_files[id] == name;
+		});
+	}
+
+	uint32_t src_file(const std::string& file) {
+		const uint32_t name = _strings.intern(file);
+		uint32_t id = _src_file_ids.find(hash_ids(name), [this, name](const uint32_t i) {
+			return _src_files[i] == name;
+		});
+		if (NOT_SET != id)
+			return id;
+		id = _src_files.size();
+		_src_files.push_back(name);
+		_src_file_ids.insert(hash_ids(name), id, [this](const uint32_t i) {
+			return hash_ids(_src_files[i]);
+		});
+		return id;
+	}
+
+	// Appends the variables and types parsed by the workers in the order
+	// of the compilation units in the binary, as if they were parsed by
+	// a single thread.
+	void merge(std::vector<std::unique_ptr<Imp> >& workers) {
+		struct chunk {
+			unsigned cu_index;
+			unsigned worker;
+			size_t begin, end;
+		};
+		std::vector<chunk> chunks;
+		// worker's string, file and CU ids to ours, per worker
+		std::vector<std::vector<uint32_t> > strings(workers.size());
+		std::vector<std::vector<uint32_t> > files(workers.size());
+		std::vector<std::vector<uint32_t> > cus(workers.size());
+
+		for (unsigned w = 0; w < workers.size(); ++w) {
+			Imp& imp = *workers[w];
+			const std::vector<char>& chars = imp._strings.chars();
+			strings[w].assign(chars.size(), 0);
+			for (size_t i = 1; i < chars.size(); i += strlen(&chars[i]) + 1)
+				strings[w][i] = _strings.intern(&chars[i]);
+			for (auto f = imp._src_files.begin(); imp._src_files.end() != f; ++f)
+				files[w].push_back(src_file(imp._strings.str(*f)));
+			for (unsigned cu = 0; cu < imp._cu_files.size(); ++cu) {
+				cus[w].push_back(cu_id(imp._cu_files[cu]));
+				CUTypes& from = imp._cu_types[cu];
+				CUTypes& to = _cu_types[cus[w].back()];
+				for (auto t = from.types.begin(); from.types.end() != t; ++t) {
+					to.types.push_back(*t);
+					to.types.back().name = strings[w][t->name];
+				}
+				for (auto m = from.members.begin(); from.members.end() != m; ++m) {
+					to.members.push_back(*m);
+					to.members.back().name = strings[w][m->name];
+				}
+				std::vector<basetype_desc>().swap(from.types);
+				std::vector<member_desc>().swap(from.members);
+			}
+
+			const auto& starts = imp._cu_var_starts;
+			for (size_t i = 0; i < starts.size(); ++i) {
+				chunk c = {starts[i].first, w, starts[i].second,
+					i + 1 < starts.size() ? starts[i + 1].second : imp._vars.size()};
+				chunks.push_back(c);
+			}
+		}
+
+		std::sort(chunks.begin(), chunks.end(),
+			[](const chunk& a, const chunk& b) {
+				return a.cu_index < b.cu_index;
+			});
+		for (auto c = chunks.begin(); chunks.end() != c; ++c) {
+			const Vars_t& vars = workers[c->worker]->_vars;
+			for (size_t i = c->begin; i < c->end; ++i) {
+				Variable v = vars[i];
+				if (NOT_SET != v.file_id())
+					v.setFile(files[c->worker][v.file_id()]);
+				v.setName(strings[c->worker][v.name()]);
+				v.setCU(cus[c->worker][v.cu()]);
+				_vars.push_back(v);
+			}
+		}
+	}
+
+	// Fixes the scopes of the variables as debugging info often gives
+	// incorrect values. Every source file is parsed once.
+	void fix_scopes(const size_t first_var, const unsigned threads) {
+		std::vector<std::string> files;
+		for (auto i = _src_files.begin(); _src_files.end() != i; ++i)
+			files.push_back(_strings.str(*i));
+		_scoping.add(files, std::string(), threads);
+
+		for (auto var = _vars.begin() + first_var; _vars.end() != var; ++var) {
+			if (NOT_SET == var->file_id())
+				continue;
+			const std::string& file = files[var->file_id()];
+			if (var->param())
+				var->setLine(_scoping.nextScope(file, var->line()));
+			std::pair<int, int> ranges = _scoping.scope(file, var->line());
+			var->setVisEndLine(ranges.second);
+			MY_PRINT("@VARIABLE: [%u] \"%s\" %u-%u (%s)\n",
+				var->type_offset(),
+				_strings.str(var->name()),
+				var->line(), var->visEndsLine(),
+				file.c_str());
+		}
+	}
+
+	// A type chain followed down to the named type (@sa resolve_chain)
+	struct chain_desc {
+		std::string name;
+		uint32_t top_offset;	// offset of the named type
+		uint32_t size;			// first size found along the chain
+		uint32_t count;			// first array count found along the chain
+	};
+
+	// Follows the chain of types starting at 'offset' (typedefs,
+	// pointers, const, ...) down to the named type. 'types' are sorted by
+	// offset.
+	chain_desc resolve_chain(const std::vector<basetype_desc>& types,
+		const uint32_t offset) const {
+
+		chain_desc t;
+		t.top_offset = offset;
+		t.size = t.count = 0;
+		std::string suffix;
+		uint32_t current_offset = offset;
+		for (int i = max_refs; i > 0; --i) {
+			auto it = std::lower_bound(types.begin(), types.end(), current_offset,
+				[](const basetype_desc& d, const uint32_t o) {
+					return d.offset < o;
+				});
+			const basetype_desc *desc = (types.end() != it &&
+				current_offset == it->offset) ? &*it : 0;
+			if (desc && !t.count && desc->count)
+				t.count = desc->count;
+			if (desc && !t.size && desc->size)
+				t.size = desc->size;
+
+			if (!desc || 0 == desc->next) {
+				t.top_offset = current_offset;
+				if (!desc || 0 == desc->name)
+					t.name = "void" + (suffix.empty() ? "*" : suffix);
+				else
+					t.name = _strings.str(desc->name) + suffix;
+				return t;
+			}
+			if (desc->suffix)
+				suffix = desc->suffix + suffix;
+			current_offset = desc->next;
+		}
+		// Looped chain
+		t.top_offset = offset;
+		t.name = std::string();
+		return t;
+	}
+
+	// Layout of the structure at 'str_offset' in 'cu', shared with all the
+	// equal layouts found before. NOT_SET if the type has no fields.
+	uint32_t layout_of(const CUTypes& cu, const uint32_t str_offset) {
+		auto range = std::equal_range(cu.members.begin(), cu.members.end(),
+			str_offset, member_less());
+		if (range.first == range.second)
+			return NOT_SET;
+
+		const uint32_t first = _fields.size();
+		for (auto m = range.first; range.second != m; ++m) {
+			// A later field at the same offset replaces the earlier one
+			if (range.second != m + 1 && m->offset == (m + 1)->offset)
+				continue;
+			chain_desc ft = resolve_chain(cu.types, m->type);
+			field_layout fl = {m->offset, ft.size, ft.count, m->name};
+			_fields.push_back(fl);
+		}
+		const uint32_t last = _fields.size();
+
+		auto hash_of = [this](const uint32_t l) {
+			size_t h = 0;
+			for (uint32_t i = _layout_starts[l]; i < _layout_starts[l + 1]; ++i)
+				h = hash_ids(h ^ _fields[i].offset ^ (uint64_t(_fields[i].name) << 32));
+			return h;
+		};
+		// Candidate layout id, its fields are the tail of _fields
+		const uint32_t id = _layout_starts.size() - 1;
+		_layout_starts.push_back(last);
+		const uint32_t same = _layout_ids.find(hash_of(id), [this, id](const uint32_t l) {
+			const uint32_t n = _layout_starts[l + 1] - _layout_starts[l];
+			if (n != _layout_starts[id + 1] - _layout_starts[id])
+				return false;
+			for (uint32_t i = 0; i < n; ++i) {
+				const field_layout& a = _fields[_layout_starts[l] + i];
+				const field_layout& b = _fields[_layout_starts[id] + i];
+				if (a.offset != b.offset || a.size != b.size ||
+					a.count != b.count || a.name != b.name)
+					return false;
+			}
+			return true;
+		});
+		if (NOT_SET != same) {
+			_fields.resize(first);
+			_layout_starts.pop_back();
+			return same;
+		}
+		_layout_ids.insert(hash_of(id), id, hash_of);
+		return id;
+	}
+
+	struct member_less {
+		bool operator()(const member_desc& a, const member_desc& b) const {
+			return a.str_offset < b.str_offset;
+		}
+		bool operator()(const member_desc& a, const uint32_t o) const {
+			return a.str_offset < o;
+		}
+		bool operator()(const uint32_t o, const member_desc& b) const {
+			return o < b.str_offset;
+		}
+	};
+
+	uint32_t type_id(const uint32_t name, const uint32_t fields) {
+		auto hash_of = [this](const uint32_t t) {
+			return hash_ids((uint64_t(_types[t].name) << 32) ^ _types[t].fields);
+		};
+		const size_t hash = hash_ids((uint64_t(name) << 32) ^ fields);
+		uint32_t id = _type_ids.find(hash, [this, name, fields](const uint32_t t) {
+			return _types[t].name == name && _types[t].fields == fields;
+		});
+		if (NOT_SET != id)
+			return id;
+		id = _types.size();
+		resolved_type t = {name, fields};
+		_types.push_back(t);
+		_type_ids.insert(hash, id, hash_of);
+		return id;
+	}
+
+	// Resolves the types of the variables from 'first_var' on and the
+	// layouts of the structures they refer to. The raw per-CU tables are
+	// not needed afterwards and are released.
+	void resolve_types(const size_t first_var = 0) {
+		if (0 == first_var) {
+			_types.clear();
+			_type_ids.clear();
+			_fields.clear();
+			_layout_starts.assign(1, 0);
+			_layout_ids.clear();
+		}
+		for (auto cu = _cu_types.begin(); _cu_types.end() != cu; ++cu) {
+			std::stable_sort(cu->types.begin(), cu->types.end(),
+				[](const basetype_desc& a, const basetype_desc& b) {
+					return a.offset < b.offset;
+				});
+			std::stable_sort(cu->members.begin(), cu->members.end(),
+				[](const member_desc& a, const member_desc& b) {
+					if (a.str_offset != b.str_offset)
+						return a.str_offset < b.str_offset;
+					return a.offset < b.offset;
+				});
+		}
+
+		// type offset -> resolved type id, per compilation unit
+		std::vector<std::unordered_map<uint32_t, uint32_t> > type_ids(_cu_types.size());
+		// structure offset -> layout id, per compilation unit
+		std::vector<std::unordered_map<uint32_t, uint32_t> > layout_ids(_cu_types.size());
+
+		for (auto v = _vars.begin() + first_var; _vars.end() != v; ++v) {
+			if (NOT_SET == v->type_offset())
+				continue;
+			auto id = type_ids[v->cu()].find(v->type_offset());
+			if (type_ids[v->cu()].end() != id) {
+				v->setType(id->second);
+				continue;
+			}
+
+			const CUTypes& cu = _cu_types[v->cu()];
+			chain_desc t = resolve_chain(cu.types, v->type_offset());
+			uint32_t fields = NOT_SET;
+			auto lid = layout_ids[v->cu()].find(t.top_offset);
+			if (layout_ids[v->cu()].end() != lid) {
+				fields = lid->second;
+			} else {
+				fields = layout_of(cu, t.top_offset);
+				layout_ids[v->cu()][t.top_offset] = fields;
+			}
+
+			const uint32_t type = type_id(_strings.intern(t.name), fields);
+			type_ids[v->cu()][v->type_offset()] = type;
+			v->setType(type);
+		}
+
+		for (auto cu = _cu_types.begin(); _cu_types.end() != cu; ++cu) {
+			std::vector<basetype_desc>().swap(cu->types);
+			std::vector<member_desc>().swap(cu->members);
+		}
+	}
+
 private:
 	Variable& newVar() {
-		_vars.push_back(Variable(&_src_files, &_base_types,
-			&_base_type_suffix));
+		_vars.push_back(Variable(_cur_cu));
 		return _vars[_vars.size() - 1];
 	}
 
+	// Id of the compilation unit (@sa _cu_files)
+	unsigned cu_id(const std::string& cu) {
+		auto it = _cu_ids.find(cu);
+		if (_cu_ids.end() != it)
+			return it->second;
+		_cu_files.push_back(cu);
+		_cu_types.push_back(CUTypes());
+		return _cu_ids[cu] = _cu_files.size() - 1;
+	}
+
 	void cancelVar() {
 		_vars.pop_back();
 	}
 
-	basetype_desc& newBaseType(const size_t offset, const std::string& file) {
-		return _base_types[file][offset];
+	basetype_desc& newBaseType(const uint32_t offset) {
+		const basetype_desc desc = {offset, 0, 0, 0, 0, 0};
+		std::vector<basetype_desc>& types = _cu_types[_cur_cu].types;
+		types.push_back(desc);
+		return types.back();
 	}
 
 
 private:
 
+	StringPool	_strings;
 	Vars_t		_vars;
-	SrcFiles_t	_src_files;
-	BaseTypes_t	_base_types;
-
-	BaseTypeSuffix_t _base_type_suffix;
-	mutable StructFields_t _struct_fields;
+	// Ids of the variables with a file, sorted by (file, name, line)
+	std::vector<uint32_t> _var_order;
+	// Source file id -> name (@sa StringPool)
+	std::vector<uint32_t> _src_files;
+	IdTable		_src_file_ids;
+
+	std::vector<resolved_type> _types;
+	IdTable		_type_ids;
+	// Structure layouts: the fields of layout l are
+	// _fields[_layout_starts[l] .. _layout_starts[l + 1]), sorted by offset
+	std::vector<field_layout> _fields;
+	std::vector<uint32_t> _layout_starts;
+	IdTable		_layout_ids;
+
+	// Compilation units the variables were found in
+	std::vector<std::string> _cu_files;
+	std::unordered_map<std::string, unsigned> _cu_ids;
+	std::vector<CUTypes> _cu_types;
+	unsigned	_cur_cu;	// CU being parsed
 
 
 	scoping		_scoping;
-
-	// Required to gather all info about the structure (@sa StructFields_t)
+	bool		_lazy;
+	std::mutex	_load_lock;			// serializes the lazy loads (@sa query)
+	std::atomic<bool> _ready;		// init is complete (@sa query)
+
+	// This instance parses every _workers-th compilation unit starting
+	// from _worker (@sa init, merge)
+	unsigned	_worker;
+	unsigned	_workers;
+	unsigned	_cu_count;
+	// (CU index, first variable of the CU in _vars)
+	std::vector<std::pair<unsigned, size_t> > _cu_var_starts;
+
+	// Required to gather all info about the structure (@sa member_desc)
 	struct TypeContainer {
 		bool		_valid;
 		unsigned _type_offset;
 		unsigned _field_type_offset;
 		std::string _fieldname;
 		int			_offset;
-		FieldsNames_t *_fields;
-		basetype_desc *_basetype;
+		unsigned	_cu;
+		size_t		_basetype;	// index in CUTypes::types
 	};
 
 #ifdef __linux
 private:
 	std::map<Dwarf_Addr, Dwarf_Unsigned> _pcaddr2line;
+	// Lazy mode state (@sa open_lazy)
+	int			_lazy_fd;
+	Elf			*_lazy_elf;
+	Dwarf_Debug	_lazy_dbg;
+	std::vector<Dwarf_Off> _cu_die_offsets;
+	// The tables of a source file in the lazy mode, once loaded
+	struct LazyFile {
+		LazyFile() : tables(0) {}
+		std::vector<unsigned> cus;	// using the file
+		std::atomic<const Imp *> tables;
+	};
+	// source file -> its CUs and tables, filled by init (@sa index_cus)
+	std::unordered_map<std::string, LazyFile> _lazy_files;
 	std::string _file;
 	std::string _comp_dir;
 
@@ -330,7 +896,7 @@ private:
 	void get_attribute(
 		Dwarf_Debug dbg, Dwarf_Die die, Dwarf_Half attr,
 		Dwarf_Attribute attr_in, int die_indent_level,
-		const char *tag_name, char **srcfiles, const std::vector<std::string>& srclist, const char **const cfile,
+		const char *tag_name, char **srcfiles, const char **const cfile,
 		Dwarf_Signed cnt, Dwarf_Off parent_offset,
 		Variable *const var = 0, basetype_desc *const basetype = 0,
 		TypeContainer ** tcon = 0) {
@@ -385,8 +951,10 @@ private:
 
 			if (!!(*tcon) && (*tcon)->_valid) {
 				(*tcon)->_offset = offset;
-				(*(*tcon)->_fields)[offset].name = (*tcon)->_fieldname;
-				(*(*tcon)->_fields)[offset].typeoffset = (*tcon)->_field_type_offset;
+				const member_desc member = {(*tcon)->_type_offset,
+					uint32_t(offset), (*tcon)->_field_type_offset,
+					_strings.intern((*tcon)->_fieldname)};
+				_cu_types[(*tcon)->_cu].members.push_back(member);
 				MY_PRINT("@FIELD: [%d] off=%d field=%s fieldtype=%d\n",
 					(*tcon)->_type_offset, offset,
 					(*tcon)->_fieldname.c_str(),
@@ -400,23 +968,26 @@ private:
 			sres = dwarf_formstring(attr_in, &name, &err);
 			if (DW_DLV_OK != sres) { MY_PRINT("failed to read string attribute\n"); goto dealloc_form; }
 			_file = std::string() + name + '/' + _file;
+			_cur_cu = cu_id(_file);
 			*cfile = _file.c_str();	
 			MY_PRINT("\"%s\" ", name);
 			_comp_dir = name;
-			_scoping.init(srclist, _comp_dir + '/');
 			dwarf_dealloc(dbg, name, DW_DLA_STRING); 
 		} else if (SEQ("DW_AT_name")) {
 			char *name = 0;
 			sres = dwarf_formstring(attr_in, &name, &err);
 			if (DW_DLV_OK != sres) { MY_PRINT("failed to read string attribute\n"); goto dealloc_form; }
-			if (0 == die_indent_level)
+			if (0 == die_indent_level) {
 				_file = name;
+				_cur_cu = cu_id(_file);
+			}
 			MY_PRINT("\"%s\" ", name);
 			if (!!var) {
-				var->setName(name);
+				var->setName(_strings.intern(name));
 				var->setVisEndLine(_vis_end_line);
 			} else if (!!basetype) {
-				basetype->name = name;
+				basetype->name = _strings.intern(name);
+				basetype->next = 0;
 			}
 			if (!!(*tcon) && (*tcon)->_valid) {
 				(*tcon)->_fieldname = name;
@@ -438,7 +1009,7 @@ private:
 				//printf("%s\n", full_path.c_str());
 			}
 			if (!!var)
-				var->setFile(full_path);
+				var->setFile(src_file(full_path));
 			if (!!(*tcon) && (0 == strcmp(tag_name, "DW_TAG_structure_type") || 0 == strcmp(tag_name, "DW_TAG_class_type")
 				)
 			) {
@@ -457,7 +1028,7 @@ private:
 			}
 			MY_PRINT("\"%lli\" ", uval);
 			if (0 == strcmp(tag_name, "DW_TAG_formal_parameter") && !!var)
-				uval = _scoping.nextScope(var->file(), uval);
+				var->setParam();
 			if (!!var)
 				var->setLine(uval);
 		}
@@ -470,8 +1041,9 @@ private:
 				basetype->size = val;
 			}
 			if (SEQ("DW_AT_upper_bound")) {
-				if (!!tcon && !!*tcon) {
-					(*tcon)->_basetype->count = val;
+				if (!!tcon && !!*tcon && NOT_SET != (*tcon)->_basetype &&
+					(*tcon)->_basetype < _cu_types[(*tcon)->_cu].types.size()) {
+					_cu_types[(*tcon)->_cu].types[(*tcon)->_basetype].count = val;
 				}
 			}
 		}
@@ -500,17 +1072,15 @@ private:
 				var->setTypeOffset(offset);
 			}
 			else if (!!basetype) {
-				std::stringstream ss;
-				ss << offset;
-				basetype->name = ss.str();
+				basetype->next = offset;
 				if (0 == strcmp(tag_name, "DW_TAG_pointer_type"))
-					_base_type_suffix[_file][parent_offset] = "*";
+					basetype->suffix = "*";
 				else if (0 == strcmp(tag_name, "DW_TAG_const_type"))
-					_base_type_suffix[_file][parent_offset] = " const";
+					basetype->suffix = " const";
 				else if (0 == strcmp(tag_name, "DW_TAG_reference_type"))
-					_base_type_suffix[_file][parent_offset] = "&";
+					basetype->suffix = "&";
 				else if (0 == strcmp(tag_name, "DW_TAG_volatile_type"))
-					_base_type_suffix[_file][parent_offset] = " volatile";
+					basetype->suffix = " volatile";
 			}
 
 			if (!!(*tcon) && (*tcon)->_valid) {
@@ -527,7 +1097,7 @@ dealloc_attr:;
 
 	bool print_one_die(Dwarf_Debug dbg, Dwarf_Die die,
 		int die_indent_level, char **srcfiles,
-		const char* *const cfile, Dwarf_Signed cnt, const std::vector<std::string>& srclist, TypeContainer ** tcon = 0) {
+		const char* *const cfile, Dwarf_Signed cnt, TypeContainer ** tcon = 0) {
 
 		Dwarf_Error_s *err;
 		Dwarf_Half tag = 0;
@@ -594,7 +1164,7 @@ dealloc_attr:;
 			0 == strcmp(tagname, "DW_TAG_structure_type") ||
 			0 == strcmp(tagname, "DW_TAG_class_type") ||
 			0 == strcmp(tagname, "DW_TAG_array_type")) {
-			basetype = &newBaseType(offset, _file);
+			basetype = &newBaseType(offset);
 			//printf("%s ", tagname);
 			//printf("=TYPES: off=%d file=%s\n", offset, _file.c_str());
 		}
@@ -606,8 +1176,9 @@ dealloc_attr:;
 			delete (*tcon);
 			*tcon = new TypeContainer;
 			(*tcon)->_type_offset = offset;
-			(*tcon)->_fields = &_struct_fields[hasher(_file + std::to_string((*tcon)->_type_offset))];
-			(*tcon)->_basetype = basetype;
+			(*tcon)->_cu = _cur_cu;
+			(*tcon)->_basetype = !!basetype ?
+				_cu_types[_cur_cu].types.size() - 1 : size_t(NOT_SET);
 				//printf("=FIELDS: off=%d file=%s\n", (*tcon)->_type_offset, _file.c_str());
 
 		}
@@ -636,7 +1207,7 @@ dealloc_attr:;
 			MY_PRINT("%*s", 2 * die_indent_level + 1, " ");
 			get_attribute(dbg, die, attr, atlist[i],
 				die_indent_level, tagname,
-				srcfiles, srclist, cfile, cnt, offset, var, basetype, tcon);
+				srcfiles, cfile, cnt, offset, var, basetype, tcon);
 		}
 		for (Dwarf_Signed i = 0; i < atcnt; ++i)
 			dwarf_dealloc(dbg, atlist[i], DW_DLA_ATTR);
@@ -644,26 +1215,15 @@ dealloc_attr:;
 			dwarf_dealloc(dbg, atlist, DW_DLA_LIST);
 
 		if (!!var) {
-			if (size_t(Variable::VALUE_NOT_SET) == var->line() ||
-				var->name().empty()) {
+			if (NOT_SET == var->line() || 0 == var->name()) {
 				cancelVar();
 				return true;
 			}
-			// Fix the end line of the scope as debugging info
-			// often gives incorrect values.
-			std::pair<int, int> ranges = _scoping.scope(var->file(),
-				var->line());
-			var->setVisEndLine(ranges.second);
-			MY_PRINT("@VARIABLE: [%lu] \"%s\" %lu-%lu (%s)\n",
-				var->type_offset(),
-				var->name().c_str(),
-				var->line(), var->visEndsLine(),
-				var->file().c_str());
 		}
 		else if (!!basetype) {
-			MY_PRINT("@BASETYPE: %llu[%s] -> %s \"%s\", size=%lu, count=%lu (%s)\n", offset,
-				tagname, basetype->name.c_str(),
-				_base_type_suffix[_file][offset].c_str(), basetype->size, basetype->count, _file.c_str());
+			MY_PRINT("@BASETYPE: %llu[%s] -> %s/%u \"%s\", size=%u, count=%u (%s)\n", offset,
+				tagname, _strings.str(basetype->name), basetype->next,
+				basetype->suffix ? basetype->suffix : "", basetype->size, basetype->count, _file.c_str());
 		}
 		//dwarf_dealloc(dbg, (void *)tagname, DW_DLA_STRING);
 		return true;
@@ -674,7 +1234,7 @@ dealloc_tag_name:
 
 	void print_die_and_children(Dwarf_Debug dbg,
 		Dwarf_Die in_die_in, Dwarf_Bool is_info, char **srcfiles,
-		const char **const cfile, Dwarf_Signed cnt, const std::vector<std::string>& srclist, TypeContainer **tcon = 0) {
+		const char **const cfile, Dwarf_Signed cnt, TypeContainer **tcon = 0) {
 
 		Dwarf_Die in_die = in_die_in;
 		Dwarf_Error_s *err;
@@ -685,14 +1245,14 @@ dealloc_tag_name:
 
 		for (;;) {
 			if (print_one_die(dbg, in_die, _die_stack_indent_level,
-				srcfiles, cfile, cnt, srclist, tcon)) {
+				srcfiles, cfile, cnt, tcon)) {
 				
 				cdres = dwarf_child(in_die, &child, &err);
 	
 				if (DW_DLV_OK == cdres) {
 					++_die_stack_indent_level;
 					print_die_and_children(dbg, child, is_info,
-						srcfiles, cfile, cnt, srclist, tcon);
+						srcfiles, cfile, cnt, tcon);
 					--_die_stack_indent_level;
 					dwarf_dealloc(dbg, child, DW_DLA_DIE);
 					child = 0;
@@ -774,7 +1334,7 @@ dealloc_tag_name:
 		dwarf_srclines_dealloc(dbg, linebuf, linecount);
 	} 
 
-	int print_info(Dwarf_Debug &dbg, bool src_lines_nfo) {
+	int print_info(Dwarf_Debug &dbg) {
 
 		Dwarf_Error_s *err;
 		Dwarf_Unsigned cu_header_length = 0;
@@ -789,13 +1349,12 @@ dealloc_tag_name:
 
 		MY_PRINT("[[Section .debug_info]]\n");
 
-		unsigned iteration = 0;
 		int nres = 0;
 		int sres = DW_DLV_OK;
 		Dwarf_Die cu_die = 0;
 		TypeContainer *tcon = 0;
 		// REF print_die.c : 400	
-		for (;;++iteration) {
+		for (;;++_cu_count) {
 //			MY_PRINT("*\n");
 
 			nres = dwarf_next_cu_header_c(dbg, 1, &cu_header_length,
@@ -804,44 +1363,199 @@ dealloc_tag_name:
 				&typeoffset, &next_cu_offset, &err);
 
 			if (DW_DLV_NO_ENTRY == nres || DW_DLV_OK != nres)
-				return nres;
+				break;
+			// Compilation units are dealt round robin to the workers
+			if (_cu_count % _workers != _worker)
+				continue;
 
 			sres = dwarf_siblingof_b(dbg, NULL, 1, &cu_die, &err);
 			if (DW_DLV_OK != sres) {
 				MY_PRINT("error in reading siblings");
-				return sres;
+				nres = sres;
+				break;
 			}
 	
-			if (src_lines_nfo) {
-				print_line_numbers_info(dbg, cu_die);
-			} else {
+			parse_cu(dbg, cu_die, _cu_count, &tcon);
+			dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+			cu_die = 0;
+		}
+		delete tcon;
+		return nres;
+	};
+
+	// Collects the variables and types of one compilation unit
+	void parse_cu(Dwarf_Debug dbg, Dwarf_Die cu_die, const unsigned cu_index,
+		TypeContainer **tcon) {
+
+		Dwarf_Error_s *err;
+		_cur_cu = cu_id(_file);
+		// Line numbers of this CU only are needed for its scopes
+		_pcaddr2line.clear();
+		print_line_numbers_info(dbg, cu_die);
+
+		Dwarf_Signed cnt = 0;
+		char **srcfiles = 0;
+		int srcf = dwarf_srcfiles(cu_die, &srcfiles, &cnt,
+			&err);
+		if (DW_DLV_OK != srcf) {
+			srcfiles = 0;
+			cnt = 0;
+		}
+
+		_cu_var_starts.push_back(std::make_pair(cu_index,
+			_vars.size()));
+		const char * filename = 0;
+		print_die_and_children(dbg, cu_die, 1, srcfiles,
+			&filename, cnt, tcon);
+		if (DW_DLV_OK == srcf) {
+			for (int si = 0; si < cnt; ++si)
+				dwarf_dealloc(dbg, srcfiles[si], DW_DLA_STRING);
+			dwarf_dealloc(dbg, srcfiles, DW_DLA_LIST);
+		}
+		_pcaddr2line.clear();
+	}
+
+	// Lazy mode (@sa VarInfo::setLazy): the binary stays open and only
+	// the CU entries and their file tables are read by init. The CUs
+	// are parsed when a file they use is queried for the first time.
+	bool open_lazy(const char *file) {
+		_lazy_fd = open(file, O_RDONLY);
+		if (-1 == _lazy_fd) {
+			MY_PRINT("cannot open file %s\n", file);
+			return false;
+		}
+		if (elf_version(EV_CURRENT) == EV_NONE) {
+			MY_PRINT("libelf.a is out of date\n");
+		}
+		_lazy_elf = elf_begin(_lazy_fd, ELF_C_READ, NULL);
+		if (!_lazy_elf || ELF_K_ELF != elf_kind(_lazy_elf)) {
+			MY_PRINT("not an ELF file %s\n", file);
+			close_lazy();
+			return false;
+		}
+		Dwarf_Error_s *err;
+		int dres = dwarf_elf_init(_lazy_elf, DW_DLC_READ, NULL, NULL,
+			&_lazy_dbg, &err);
+		if (DW_DLV_OK != dres) {
+			MY_PRINT("No DWARF information.\n");
+			_lazy_dbg = 0;
+			close_lazy();
+			return DW_DLV_NO_ENTRY == dres;
+		}
+		index_cus();
+		return true;
+	}
+
+	void close_lazy() {
+		if (_lazy_dbg) {
+			Dwarf_Error_s *err;
+			dwarf_finish(_lazy_dbg, &err);
+			_lazy_dbg = 0;
+		}
+		if (_lazy_elf) {
+			elf_end(_lazy_elf);
+			_lazy_elf = 0;
+		}
+		if (-1 != _lazy_fd) {
+			close(_lazy_fd);
+			_lazy_fd = -1;
+		}
+	}
+
+	std::string die_string(Dwarf_Die die, Dwarf_Half attr) {
+		Dwarf_Error_s *err;
+		Dwarf_Attribute at = 0;
+		std::string str;
+		if (DW_DLV_OK != dwarf_attr(die, attr, &at, &err))
+			return str;
+		char *name = 0;
+		if (DW_DLV_OK == dwarf_formstring(at, &name, &err)) {
+			str = name;
+			dwarf_dealloc(_lazy_dbg, name, DW_DLA_STRING);
+		}
+		dwarf_dealloc(_lazy_dbg, at, DW_DLA_ATTR);
+		return str;
+	}
+
+	// Maps every source file to the CUs using it (@sa _lazy_files)
+	void index_cus() {
+		Dwarf_Error_s *err;
+		Dwarf_Unsigned cu_header_length = 0;
+		Dwarf_Half version_stamp = 0;
+		Dwarf_Unsigned abbrev_offset = 0;
+		Dwarf_Half address_size = 0;
+		Dwarf_Half length_size = 0;
+		Dwarf_Half extension_size = 0;
+		Dwarf_Sig8 signature;
+		Dwarf_Unsigned typeoffset = 0;
+		Dwarf_Unsigned next_cu_offset = 0;
+
+		for (;;) {
+			int nres = dwarf_next_cu_header_c(_lazy_dbg, 1, &cu_header_length,
+				&version_stamp, &abbrev_offset, &address_size,
+				&length_size, &extension_size, &signature,
+				&typeoffset, &next_cu_offset, &err);
+			if (DW_DLV_OK != nres)
+				break;
+			Dwarf_Die cu_die = 0;
+			if (DW_DLV_OK != dwarf_siblingof_b(_lazy_dbg, NULL, 1, &cu_die, &err))
+				break;
+
+			Dwarf_Off offset = 0;
+			if (DW_DLV_OK == dwarf_dieoffset(cu_die, &offset, &err)) {
+				const unsigned cu = _cu_die_offsets.size();
+				_cu_die_offsets.push_back(offset);
+				// The same paths as the variables get (@sa DW_AT_decl_file)
+				const std::string comp_dir = die_string(cu_die, DW_AT_comp_dir);
 				Dwarf_Signed cnt = 0;
 				char **srcfiles = 0;
-				int srcf = dwarf_srcfiles(cu_die, &srcfiles, &cnt,
-					&err);
-				if (DW_DLV_OK != srcf) {
-					srcfiles = 0;
-					cnt = 0;
-				}
-				std::vector<std::string> srclist;
-				for (int j = 0; j < cnt; ++j) {
-					srclist.push_back(srcfiles[j]);
-				}
-
-				const char * filename = 0;
-				print_die_and_children(dbg, cu_die, 1, srcfiles,
-					&filename, cnt, srclist, &tcon);
-				if (DW_DLV_OK == srcf) {
-					for (int si = 0; si < cnt; ++si)
-						dwarf_dealloc(dbg, srcfiles[si], DW_DLA_STRING);
-					dwarf_dealloc(dbg, srcfiles, DW_DLA_LIST);
+				if (DW_DLV_OK == dwarf_srcfiles(cu_die, &srcfiles, &cnt, &err)) {
+					for (Dwarf_Signed i = 0; i < cnt; ++i) {
+						std::string path = srcfiles[i];
+						if ('/' != path[0])
+							path = comp_dir + '/' + path;
+						std::vector<unsigned>& cus = _lazy_files[path].cus;
+						if (cus.empty() || cus.back() != cu)
+							cus.push_back(cu);
+						dwarf_dealloc(_lazy_dbg, srcfiles[i], DW_DLA_STRING);
+					}
+					dwarf_dealloc(_lazy_dbg, srcfiles, DW_DLA_LIST);
 				}
 			}
-			dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
-			cu_die = 0;
+			dwarf_dealloc(_lazy_dbg, cu_die, DW_DLA_DIE);
+		}
+	}
+#endif // __linux
+
+	// Builds the tables of a source file from the CUs using it (lazy
+	// mode), the same way build does with a worker. A CU using several
+	// files is parsed for each of them.
+	const Imp *load_file(const std::vector<unsigned>& cus) {
+		Imp *tables = new Imp;
+#ifdef __linux
+		tables->_file = _file;
+		tables->_die_stack_indent_level = 0;
+		TypeContainer *tcon = 0;
+		Dwarf_Error_s *err;
+		for (auto cu = cus.begin(); cus.end() != cu; ++cu) {
+			Dwarf_Die cu_die = 0;
+			if (DW_DLV_OK != dwarf_offdie_b(_lazy_dbg, _cu_die_offsets[*cu],
+				1, &cu_die, &err))
+				continue;
+			tables->_die_stack_indent_level = 0;
+			tables->parse_cu(_lazy_dbg, cu_die, *cu, &tcon);
+			dwarf_dealloc(_lazy_dbg, cu_die, DW_DLA_DIE);
 		}
 		delete tcon;
-	};
+
+		tables->fix_scopes(0, 1);
+		tables->resolve_types();
+		tables->build_index();
+		tables->release_build_state();
+#endif // __linux
+		return tables;
+	}
+#ifdef __linux
 
 	int collect_vars_info(Elf * elf) {
 		Dwarf_Debug dbg;
@@ -856,8 +1570,7 @@ dealloc_tag_name:
 			return 0;
 		}
 	
-		print_info(dbg, /*gather_lines_info=*/true);
-		print_info(dbg, false);	
+		print_info(dbg);
 
 		dwarf_finish(dbg, &err);
 		return 1;
@@ -904,32 +1617,318 @@ dealloc_tag_name:
 		close(fd);
 		return 1 == e;
 	}
+
+	// GNU build-id of the binary as a hex string, empty if it has none
+	std::string build_id(int fd) const {
+		std::string id;
+		if (elf_version(EV_CURRENT) == EV_NONE)
+			return id;
+		Elf *elf = elf_begin(fd, ELF_C_READ, NULL);
+		if (!elf)
+			return id;
+		Elf_Scn *scn = 0;
+		while (id.empty() && 0 != (scn = elf_nextscn(elf, scn))) {
+			GElf_Shdr shdr;
+			if (!gelf_getshdr(scn, &shdr) || SHT_NOTE != shdr.sh_type)
+				continue;
+			Elf_Data *data = elf_getdata(scn, 0);
+			if (!data)
+				continue;
+			GElf_Nhdr nhdr;
+			size_t offset = 0, name_offset = 0, desc_offset = 0;
+			while (0 != (offset = gelf_getnote(data, offset, &nhdr,
+				&name_offset, &desc_offset))) {
+				if (NT_GNU_BUILD_ID != nhdr.n_type || 4 != nhdr.n_namesz ||
+					0 != memcmp((char *)data->d_buf + name_offset, "GNU", 4))
+					continue;
+				const unsigned char *desc =
+					(unsigned char *)data->d_buf + desc_offset;
+				for (unsigned i = 0; i < nhdr.n_descsz; ++i) {
+					char hex[3];
+					snprintf(hex, sizeof(hex), "%02x", desc[i]);
+					id += hex;
+				}
+				break;
+			}
+		}
+		elf_end(elf);
+		return id;
+	}
+
+	// Name of the cache entry for the binary: its build-id, or a hash of
+	// its path with its size and modification time when it has none.
+	std::string cache_key(const std::string& file) const {
+		int fd = open(file.c_str(), O_RDONLY);
+		if (-1 == fd)
+			return std::string();
+		std::string key = build_id(fd);
+		struct stat st;
+		if (key.empty() && 0 == fstat(fd, &st)) {
+			char buf[64];
+			snprintf(buf, sizeof(buf), "%016llx-%llx-%llx",
+				(unsigned long long)std::hash<std::string>()(file),
+				(unsigned long long)st.st_mtime,
+				(unsigned long long)st.st_size);
+			key = buf;
+		}
+		close(fd);
+		return key;
+	}
+
+	// On-disk cache of the tables built by init (@sa VarInfo::setCacheDir).
+	// The file is a header followed by the flat tables exactly as they are
+	// kept in memory, so loading maps it and copies the arrays, with no
+	// DWARF or source parsing.
+	enum {CACHE_VERSION = 2};
+	struct cache_header {
+		char		magic[8];
+		uint32_t	version;
+		uint32_t	vars;
+		uint32_t	var_order;
+		uint32_t	files;
+		uint32_t	types;
+		uint32_t	fields;
+		uint32_t	layouts;
+		uint32_t	reserved;
+		uint64_t	strings;		// size of the string arena
+	};
+	// Followed by: Variable vars[vars], field_layout fields[fields],
+	// resolved_type types[types], uint32_t var_order[var_order],
+	// uint32_t files[files], uint32_t layout_starts[layouts + 1] and the
+	// string arena.
+
+	static const char *cache_magic() { return "VARINFO"; }
+
+	static size_t cache_size(const cache_header& h) {
+		return sizeof(cache_header) +
+			size_t(h.vars) * sizeof(Variable) +
+			size_t(h.fields) * sizeof(field_layout) +
+			size_t(h.types) * sizeof(resolved_type) +
+			size_t(h.var_order) * sizeof(uint32_t) +
+			size_t(h.files) * sizeof(uint32_t) +
+			(size_t(h.layouts) + 1) * sizeof(uint32_t) +
+			h.strings;
+	}
+
+	bool save_cache(const std::string& dir, const std::string& path) const {
+		cache_header h;
+		memset(&h, 0, sizeof(h));
+		strncpy(h.magic, cache_magic(), sizeof(h.magic));
+		h.version = CACHE_VERSION;
+		h.vars = _vars.size();
+		h.var_order = _var_order.size();
+		h.files = _src_files.size();
+		h.types = _types.size();
+		h.fields = _fields.size();
+		h.layouts = _layout_starts.size() - 1;
+		h.strings = _strings.chars().size();
+
+		mkdir(dir.c_str(), 0755);
+		// Written aside and renamed so that concurrent runs never see a
+		// partial file.
+		const std::string tmp = path + ".tmp." + std::to_string(getpid());
+		FILE *f = fopen(tmp.c_str(), "wb");
+		if (!f)
+			return false;
+		#define WRITE_ALL(v)	(v.empty() || \
+			v.size() == fwrite(&v[0], sizeof(v[0]), v.size(), f))
+		bool ok = 1 == fwrite(&h, sizeof(h), 1, f) &&
+			WRITE_ALL(_vars) && WRITE_ALL(_fields) && WRITE_ALL(_types) &&
+			WRITE_ALL(_var_order) && WRITE_ALL(_src_files) &&
+			WRITE_ALL(_layout_starts) && WRITE_ALL(_strings.chars());
+		#undef WRITE_ALL
+		ok = 0 == fclose(f) && ok;
+		if (ok)
+			ok = 0 == rename(tmp.c_str(), path.c_str());
+		if (!ok)
+			unlink(tmp.c_str());
+		return ok;
+	}
+
+	bool load_cache(const std::string& path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (-1 == fd)
+			return false;
+		struct stat st;
+		if (0 != fstat(fd, &st) || size_t(st.st_size) < sizeof(cache_header)) {
+			close(fd);
+			return false;
+		}
+		void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (MAP_FAILED == map)
+			return false;
+		const bool ok = load_cache((const char *)map, st.st_size);
+		munmap(map, st.st_size);
+		if (!ok)
+			MY_PRINT("stale or broken cache %s\n", path.c_str());
+		return ok;
+	}
+
+	bool load_cache(const char *const base, const size_t size) {
+		const cache_header& h = *(const cache_header *)base;
+		if (0 != memcmp(h.magic, cache_magic(), strlen(cache_magic()) + 1) ||
+			CACHE_VERSION != h.version || cache_size(h) != size)
+			return false;
+		const Variable *vars = (const Variable *)(base + sizeof(h));
+		const field_layout *fields = (const field_layout *)(vars + h.vars);
+		const resolved_type *types = (const resolved_type *)(fields + h.fields);
+		const uint32_t *var_order = (const uint32_t *)(types + h.types);
+		const uint32_t *files = var_order + h.var_order;
+		const uint32_t *layout_starts = files + h.files;
+		const char *strings = (const char *)(layout_starts + h.layouts + 1);
+
+		// Ids are checked so that a broken file can't make queries read
+		// out of the tables
+		auto bad_string = [&h, strings](const uint32_t id) {
+			return id >= h.strings || (id && '\0' != strings[id - 1]);
+		};
+		if (0 == h.strings || '\0' != strings[0] || '\0' != strings[h.strings - 1] ||
+			0 != layout_starts[0] || h.fields != layout_starts[h.layouts])
+			return false;
+		for (uint32_t i = 0; i < h.layouts; ++i) {
+			if (layout_starts[i] > layout_starts[i + 1])
+				return false;
+		}
+		for (uint32_t i = 0; i < h.fields; ++i) {
+			if (bad_string(fields[i].name))
+				return false;
+		}
+		for (uint32_t i = 0; i < h.types; ++i) {
+			if (bad_string(types[i].name) ||
+				(NOT_SET != types[i].fields && types[i].fields >= h.layouts))
+				return false;
+		}
+		for (uint32_t i = 0; i < h.files; ++i) {
+			if (bad_string(files[i]))
+				return false;
+		}
+		for (uint32_t i = 0; i < h.vars; ++i) {
+			if (bad_string(vars[i].name()) ||
+				(NOT_SET != vars[i].file_id() && vars[i].file_id() >= h.files) ||
+				(NOT_SET != vars[i].type() && vars[i].type() >= h.types))
+				return false;
+		}
+		for (uint32_t i = 0; i < h.var_order; ++i) {
+			if (var_order[i] >= h.vars)
+				return false;
+		}
+
+		_strings.assign(strings, h.strings);
+		_vars.assign(vars, vars + h.vars);
+		_var_order.assign(var_order, var_order + h.var_order);
+		_src_files.clear();
+		_src_file_ids.clear();
+		for (uint32_t i = 0; i < h.files; ++i)
+			src_file(_strings.str(files[i]));
+		_fields.assign(fields, fields + h.fields);
+		_layout_starts.assign(layout_starts, layout_starts + h.layouts + 1);
+		_types.assign(types, types + h.types);
+		_type_ids.clear();
+		_layout_ids.clear();
+		return true;
+	}
 #endif // __linux
 };
 
 
-bool VarInfo::Imp::init(const std::string& file) {
+bool VarInfo::Imp::build(const std::string& file, const unsigned threads,
+	const std::string& cache_dir, const bool lazy) {
 #ifdef __linux
 	_file = file;
 	_die_stack_indent_level = 0;
-	return read_file_debug(file.c_str());
+
+	std::string cache_path;
+	if (!cache_dir.empty()) {
+		const std::string key = cache_key(file);
+		if (!key.empty()) {
+			cache_path = cache_dir + '/' + key + ".varinfo";
+			if (load_cache(cache_path)) {
+				build_index();
+				return true;
+			}
+		}
+	}
+
+	// Nothing is cached in the lazy mode as the tables stay partial
+	if (lazy) {
+		_lazy = true;
+		return open_lazy(file.c_str());
+	}
+
+	if (threads <= 1) {
+		if (!read_file_debug(file.c_str()))
+			return false;
+	} else {
+		// libdwarf is not thread-safe, so every worker opens the file
+		// with its own handle and parses its share of the CUs.
+		std::vector<std::unique_ptr<Imp> > workers;
+		for (unsigned i = 0; i < threads; ++i) {
+			workers.push_back(std::unique_ptr<Imp>(new Imp));
+			workers.back()->_file = file;
+			workers.back()->_die_stack_indent_level = 0;
+			workers.back()->_worker = i;
+			workers.back()->_workers = threads;
+		}
+		std::vector<char> parsed(threads, false);
+		std::vector<std::thread> pool;
+		for (unsigned i = 0; i < threads; ++i) {
+			pool.push_back(std::thread([&workers, &parsed, &file, i]() {
+				parsed[i] = workers[i]->read_file_debug(file.c_str());
+			}));
+		}
+		for (auto &t : pool)
+			t.join();
+		for (unsigned i = 0; i < threads; ++i) {
+			if (!parsed[i])
+				return false;
+		}
+		merge(workers);
+	}
+	fix_scopes(0, threads);
+	resolve_types();
+	build_index();
+	if (!cache_path.empty() && !save_cache(cache_dir, cache_path))
+		MY_PRINT("cannot write cache %s\n", cache_path.c_str());
+	release_build_state();
+	return true;
 #else // __linux
 	return false; // NOT_IMPLEMENTED
 #endif // __linux
 };
 
 
-VarInfo::VarInfo() : _imp(new VarInfo::Imp) {}
+VarInfo::VarInfo() : _threads(1), _lazy(false), _imp(new VarInfo::Imp) {}
+
+void VarInfo::setThreads(const unsigned threads) {
+	_threads = threads ? threads : 1;
+}
+
+void VarInfo::setCacheDir(const std::string& dir) {
+	_cache_dir = dir;
+}
+
+void VarInfo::setLazy(const bool lazy) {
+	_lazy = lazy;
+}
 
 const std::string VarInfo::type(const std::string& file, const size_t line, const std::string& name) const {
-	return _imp->type(file, line, name);
+	return _imp->query(file, [&](const Imp& imp) {
+		return imp.type(file, line, name);
+	});
 }
 
 const std::string VarInfo::fieldname(const std::string& file, const size_t line, const std::string& name, const unsigned offset) const {
-	return _imp->fieldname(file, line, name, offset);
+	return _imp->query(file, [&](const Imp& imp) {
+		return imp.fieldname(file, line, name, offset);
+	});
+}
+
+size_t VarInfo::memoryUsage() const {
+	return _imp->memory_usage();
 }
 
 bool VarInfo::init(const std::string& file) {
 	_file = file;
-	return _imp->init(_file);
+	return _imp->init(_file, _threads, _cache_dir, _lazy);
 }
@@ -3,6 +3,14 @@
 /// extracted from a non-striped binary using libelf and
 /// libdwarf.
 ///
+/// Thread safety: init() and the set*() calls must complete before the
+/// object is shared with other threads (through a lock or a thread start).
+/// After that the tables are an immutable snapshot and type(), fieldname()
+/// and memoryUsage() may be called from any number of threads at once
+/// without locking. In the lazy mode the first query on a source file
+/// loads its tables under an internal lock; the queries on the files
+/// already loaded take no lock either.
+///
 /// Nik Zaborovsky, Sep - 2014 
 ///
 #pragma once
@@ -20,17 +28,44 @@ public:
 	/// \!brief Constructs variables data base by a binary file.
 	bool init(const std::string& file);
 
+	/// \!brief Number of threads init() parses the compilation units and
+	/// the source files with (1 by default: everything is parsed in
+	/// the calling thread).
+	void setThreads(const unsigned threads);
+
+	/// \!brief Directory where init() caches the tables it extracts, one
+	/// file per binary keyed by its build-id (or by its path and mtime).
+	/// Later runs on the same binary load the file instead of parsing
+	/// the debug info. Empty (the default) disables the cache.
+	void setCacheDir(const std::string& dir);
+
+	/// \!brief In the lazy mode init() only indexes which compilation
+	/// units use which source files, and the CUs using a file are parsed
+	/// into tables of its own the first time the file is queried (a CU
+	/// using several files that are queried is parsed for each). The
+	/// binary stays open until the object is destroyed. Only the queries
+	/// loading a file wait for each other. Nothing is written to the
+	/// cache in this mode.
+	void setLazy(const bool lazy);
+
 	/// \!brief Returns variable base type given its occurence in the file and its name.
 	const std::string type(const std::string& file, const size_t line, const std::string& name) const;
 
 	const std::string fieldname(const std::string& file, const size_t line, const std::string& name, const unsigned offset) const;
 
+	/// \!brief Bytes the extracted tables take (strings, variables, types
+	/// and the hash tables over them).
+	size_t memoryUsage() const;
+
 private:
 	VarInfo(const VarInfo&);
 	VarInfo& operator=(const VarInfo&);
 
 private:
 	std::string _file;
+	unsigned _threads;
+	std::string _cache_dir;
+	bool _lazy;
 
 	class Imp;	
 	const std::auto_ptr<Imp> _imp;